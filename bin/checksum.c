@@ -0,0 +1,343 @@
+/*
+ * Chunk checksums of phyzip archives, shared by phyzip and phyunzip
+ */
+
+#include "checksum.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* for Adler-32 checksum algorithm, see RFC 1950 Section 8.2 */
+#define ADLER32_BASE 65521
+
+/* the most bytes that can be summed before s2 could overflow 32 bits */
+#define ADLER32_NMAX 5552
+
+static unsigned long adler32_scalar(unsigned long checksum, const unsigned char* ptr, unsigned long len)
+{
+	unsigned long s1 = checksum & 0xffff;
+	unsigned long s2 = (checksum >> 16) & 0xffff;
+
+	while (len > 0) {
+		unsigned k = len < ADLER32_NMAX ? len : ADLER32_NMAX;
+		len -= k;
+
+		while (k >= 8) {
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			s1 += *ptr++;
+			s2 += s1;
+			k -= 8;
+		}
+
+		while (k-- > 0) {
+			s1 += *ptr++;
+			s2 += s1;
+		}
+
+		s1 = s1 % ADLER32_BASE;
+		s2 = s2 % ADLER32_BASE;
+	}
+
+	return (s2 << 16) + s1;
+}
+
+/*
+ * On x86 with GCC or clang the SSSE3 and AVX2 variants are built without
+ * -mssse3 or -mavx2 and only used when the CPU has them, as the kernels of
+ * the library are.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define ADLER32_SIMD
+#define ADLER32_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define ADLER32_TARGET_AVX2 __attribute__((target("avx2")))
+
+/*
+ * The data goes in blocks of 32 bytes: s1 grows by the sum of the bytes, and
+ * s2 by 32 times s1 before the block plus the bytes weighted 32, 31, ... 1.
+ * The byte sums come from psadbw against zero, the weighted sums from
+ * pmaddubsw against the weights and pmaddwd against ones. The 32 * s1 terms
+ * of a run of blocks are added to s2 at once, from the running sum of s1.
+ * A run is at most NMAX bytes, so no lane overflows before the reduction.
+ */
+static ADLER32_TARGET_SSSE3 unsigned long adler32_ssse3(unsigned long checksum, const unsigned char* ptr, unsigned long len)
+{
+	uint32_t s1 = checksum & 0xffff;
+	uint32_t s2 = (checksum >> 16) & 0xffff;
+	unsigned long blocks = len / 32;
+	const __m128i weights_high = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+	const __m128i weights_low = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(1);
+
+	len -= blocks * 32;
+	while (blocks > 0) {
+		uint32_t n = blocks < ADLER32_NMAX / 32 ? blocks : ADLER32_NMAX / 32;
+		__m128i prefix = _mm_set_epi32(0, 0, 0, s1 * n);
+		__m128i sum1 = zero;
+		__m128i sum2 = _mm_set_epi32(0, 0, 0, s2);
+
+		blocks -= n;
+		do {
+			__m128i a = _mm_loadu_si128((const __m128i*)ptr);
+			__m128i b = _mm_loadu_si128((const __m128i*)(ptr + 16));
+
+			prefix = _mm_add_epi32(prefix, sum1);
+			sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(a, zero));
+			sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_maddubs_epi16(a, weights_high), ones));
+			sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(b, zero));
+			sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_maddubs_epi16(b, weights_low), ones));
+			ptr += 32;
+		} while (--n);
+
+		sum2 = _mm_add_epi32(sum2, _mm_slli_epi32(prefix, 5));
+
+		/* horizontal sums of the four lanes */
+		sum1 = _mm_add_epi32(sum1, _mm_shuffle_epi32(sum1, _MM_SHUFFLE(2, 3, 0, 1)));
+		sum1 = _mm_add_epi32(sum1, _mm_shuffle_epi32(sum1, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum2 = _mm_add_epi32(sum2, _mm_shuffle_epi32(sum2, _MM_SHUFFLE(2, 3, 0, 1)));
+		sum2 = _mm_add_epi32(sum2, _mm_shuffle_epi32(sum2, _MM_SHUFFLE(1, 0, 3, 2)));
+		s1 = (s1 + (uint32_t)_mm_cvtsi128_si32(sum1)) % ADLER32_BASE;
+		s2 = (uint32_t)_mm_cvtsi128_si32(sum2) % ADLER32_BASE;
+	}
+
+	return adler32_scalar(((unsigned long)s2 << 16) + s1, ptr, len);
+}
+
+/* the same with one 32-byte load per block */
+static ADLER32_TARGET_AVX2 unsigned long adler32_avx2(unsigned long checksum, const unsigned char* ptr, unsigned long len)
+{
+	uint32_t s1 = checksum & 0xffff;
+	uint32_t s2 = (checksum >> 16) & 0xffff;
+	unsigned long blocks = len / 32;
+	const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+		16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+
+	len -= blocks * 32;
+	while (blocks > 0) {
+		uint32_t n = blocks < ADLER32_NMAX / 32 ? blocks : ADLER32_NMAX / 32;
+		__m256i prefix = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, s1 * n);
+		__m256i sum1 = zero;
+		__m256i sum2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, s2);
+		__m128i half1, half2;
+
+		blocks -= n;
+		do {
+			__m256i a = _mm256_loadu_si256((const __m256i*)ptr);
+
+			prefix = _mm256_add_epi32(prefix, sum1);
+			sum1 = _mm256_add_epi32(sum1, _mm256_sad_epu8(a, zero));
+			sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_maddubs_epi16(a, weights), ones));
+			ptr += 32;
+		} while (--n);
+
+		sum2 = _mm256_add_epi32(sum2, _mm256_slli_epi32(prefix, 5));
+
+		/* horizontal sums of the eight lanes */
+		half1 = _mm_add_epi32(_mm256_castsi256_si128(sum1), _mm256_extracti128_si256(sum1, 1));
+		half2 = _mm_add_epi32(_mm256_castsi256_si128(sum2), _mm256_extracti128_si256(sum2, 1));
+		half1 = _mm_add_epi32(half1, _mm_shuffle_epi32(half1, _MM_SHUFFLE(2, 3, 0, 1)));
+		half1 = _mm_add_epi32(half1, _mm_shuffle_epi32(half1, _MM_SHUFFLE(1, 0, 3, 2)));
+		half2 = _mm_add_epi32(half2, _mm_shuffle_epi32(half2, _MM_SHUFFLE(2, 3, 0, 1)));
+		half2 = _mm_add_epi32(half2, _mm_shuffle_epi32(half2, _MM_SHUFFLE(1, 0, 3, 2)));
+		s1 = (s1 + (uint32_t)_mm_cvtsi128_si32(half1)) % ADLER32_BASE;
+		s2 = (uint32_t)_mm_cvtsi128_si32(half2) % ADLER32_BASE;
+	}
+
+	return adler32_scalar(((unsigned long)s2 << 16) + s1, ptr, len);
+}
+#endif
+
+/* Adler-32 variants, from the most portable to the widest */
+struct adler32_kernel {
+	const char* name;
+	unsigned long (*update)(unsigned long checksum, const unsigned char* ptr, unsigned long len);
+};
+
+static const struct adler32_kernel adler32_kernels[] = {
+	{"scalar", adler32_scalar},
+#if defined(ADLER32_SIMD)
+	{"ssse3", adler32_ssse3},
+	{"avx2", adler32_avx2},
+#endif
+};
+
+#define ADLER32_KERNEL_COUNT	(sizeof(adler32_kernels) / sizeof(adler32_kernels[0]))
+
+static const struct adler32_kernel* adler32_kernel = &adler32_kernels[0];
+
+static int adler32_supported(const struct adler32_kernel* kernel)
+{
+#if defined(ADLER32_SIMD)
+	__builtin_cpu_init();
+	if (!strcmp(kernel->name, "ssse3"))
+		return __builtin_cpu_supports("ssse3");
+	if (!strcmp(kernel->name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	(void)kernel;
+	return 1;
+}
+
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void adler32_select_kernel(void)
+{
+	const char* forced = getenv("PHYZIP_ADLER32");
+	int k;
+
+	for (k = ADLER32_KERNEL_COUNT - 1; k >= 0; --k) {
+		if (forced && strcmp(forced, adler32_kernels[k].name))
+			continue;
+		if (adler32_supported(&adler32_kernels[k])) {
+			adler32_kernel = &adler32_kernels[k];
+			return;
+		}
+	}
+
+	/* unknown or unsupported variant: pick the best one */
+	if (forced) {
+		for (k = ADLER32_KERNEL_COUNT - 1; k > 0 && !adler32_supported(&adler32_kernels[k]); --k)
+			;
+		adler32_kernel = &adler32_kernels[k];
+	}
+}
+
+const char* adler32_kernel_name(void)
+{
+	return adler32_kernel->name;
+}
+
+unsigned long update_adler32(unsigned long checksum, const void* buf, unsigned long len)
+{
+	return adler32_kernel->update(checksum, (const unsigned char*)buf, len);
+}
+
+/*
+ * XXH64 by Yann Collet: four lanes take 8 bytes each per 32-byte stripe,
+ * then the lanes are merged and the tail and length mixed in. Its 64-bit
+ * multiplies run at memory speed on 64-bit CPUs without any SIMD.
+ */
+#define XXH_PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t xxh_read64(const unsigned char* p)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	uint64_t value;
+
+	memcpy(&value, p, 8);
+	return value;
+#else
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+#endif
+}
+
+static uint64_t xxh_read32(const unsigned char* p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH_ROTL64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t lane)
+{
+	acc ^= xxh64_round(0, lane);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxh64(const unsigned char* p, unsigned long len, uint64_t seed)
+{
+	const unsigned char* end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = xxh64_round(v1, xxh_read64(p));
+			v2 = xxh64_round(v2, xxh_read64(p + 8));
+			v3 = xxh64_round(v3, xxh_read64(p + 16));
+			v4 = xxh64_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+
+		h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+
+	h += len;
+
+	while (end - p >= 8) {
+		h ^= xxh64_round(0, xxh_read64(p));
+		h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		h ^= xxh_read32(p) * XXH_PRIME64_1;
+		h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p++ * XXH_PRIME64_5;
+		h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+unsigned long chunk_data_checksum(int options, const void* buf, unsigned long len)
+{
+	if (options & CHUNK_XXH64)
+		return (unsigned long)(xxh64((const unsigned char*)buf, len, 0) & 0xffffffff);
+
+	return update_adler32(1L, buf, len);
+}
+
+void block_fingerprint(const void* buf, unsigned long len, unsigned long fingerprint[2])
+{
+	fingerprint[0] = (unsigned long)xxh64((const unsigned char*)buf, len, 0);
+	fingerprint[1] = (unsigned long)xxh64((const unsigned char*)buf, len, XXH_PRIME64_5);
+}
@@ -0,0 +1,37 @@
+/*
+ * Chunk checksums of phyzip archives, shared by phyzip and phyunzip
+ */
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+/*
+ * Data chunk options flags, next to the codec in the low byte. By default a
+ * chunk carries the Adler-32 of its data; with CHUNK_XXH64 it carries the
+ * low 32 bits of the XXH64 (seed 0) instead. With CHUNK_RAW_CHECKSUM the
+ * checksum is taken over the uncompressed data, so it also vouches for the
+ * decoder.
+ */
+#define CHUNK_XXH64 0x200
+#define CHUNK_RAW_CHECKSUM 0x400
+
+/* continue an Adler-32 checksum (RFC 1950, start with 1) */
+unsigned long update_adler32(unsigned long checksum, const void* buf, unsigned long len);
+
+/* the checksum of a data chunk as selected by its options */
+unsigned long chunk_data_checksum(int options, const void* buf, unsigned long len);
+
+/*
+ * Fingerprint of a block for phyzip --dedup: XXH64 with seeds 0 and
+ * PRIME64_5, 128 bits in all (64-bit unsigned long assumed, as elsewhere).
+ */
+void block_fingerprint(const void* buf, unsigned long len, unsigned long fingerprint[2]);
+
+/*
+ * Name of the Adler-32 variant in use ("scalar", "ssse3" or "avx2"). The
+ * widest one the CPU supports is picked at load time; the environment
+ * variable PHYZIP_ADLER32 forces another one, e.g. PHYZIP_ADLER32=scalar.
+ */
+const char* adler32_kernel_name(void);
+
+#endif
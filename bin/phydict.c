@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "lz77.h"
+
+#define LZ77_VERSION_STRING "1.0"
+#define PHYZIP_VERSION_STRING "1.2.3"
+
+/* at most this much sample data is loaded */
+#define MAX_SAMPLES_SIZE (64 * 1024 * 1024)
+
+/* the dictionary is built from segments scored by the d-mers they contain */
+#define DMER_SIZE 8
+#define SEGMENT_SIZE 64
+#define FREQ_LOG 20
+#define FREQ_SIZE (1 << FREQ_LOG)
+
+struct samples {
+	unsigned char* data;
+	unsigned long size;
+	unsigned long* ends;
+	unsigned long count;
+	unsigned long capacity;
+};
+
+static unsigned long dmer_hash(const unsigned char* p)
+{
+	unsigned long h = 2166136261UL;
+	int c;
+
+	for (c = 0; c < DMER_SIZE; c++)
+		h = ((h ^ p[c]) * 16777619UL) & 0xffffffff;
+
+	return (h ^ (h >> 15)) & (FREQ_SIZE - 1);
+}
+
+/* append a sample file to the training set */
+int add_sample(struct samples* samples, const char* file_name)
+{
+	FILE* in;
+	unsigned long* ends;
+	size_t bytes_read;
+
+	if (samples->size >= MAX_SAMPLES_SIZE)
+		return 0;
+
+	in = fopen(file_name, "rb");
+	if (!in) {
+		printf("Error: could not open %s\n", file_name);
+		return -1;
+	}
+
+	if (samples->count == samples->capacity) {
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+		ends = (unsigned long*)realloc(samples->ends, samples->capacity * sizeof(unsigned long));
+		if (!ends) {
+			fclose(in);
+			printf("Error: not enough memory!\n");
+			return -1;
+		}
+		samples->ends = ends;
+	}
+
+	bytes_read = fread(samples->data + samples->size, 1, MAX_SAMPLES_SIZE - samples->size, in);
+	fclose(in);
+
+	if (bytes_read > 0) {
+		samples->size += bytes_read;
+		samples->ends[samples->count++] = samples->size;
+	}
+
+	return 0;
+}
+
+/* load every regular file of a directory */
+int load_samples(struct samples* samples, const char* dir_name)
+{
+	DIR* dir;
+	struct dirent* entry;
+	struct stat st;
+	char* path;
+	int result = 0;
+
+	dir = opendir(dir_name);
+	if (!dir) {
+		printf("Error: could not open directory %s\n", dir_name);
+		return -1;
+	}
+
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		path = (char*)malloc(strlen(dir_name) + strlen(entry->d_name) + 2);
+		if (!path) {
+			result = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", dir_name, entry->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			result = add_sample(samples, path);
+		free(path);
+	}
+	closedir(dir);
+
+	return result;
+}
+
+/*
+ * Simplified "cover" training: every d-mer is scored by the number of
+ * samples that contain it. The training data is split into one epoch per
+ * segment of the dictionary, and from every epoch the segment with the
+ * highest total score is taken; its d-mers then score zero, so the same
+ * content is not picked twice. The best segments end up at the end of the
+ * dictionary, closest to the data.
+ */
+unsigned long train_dictionary(const struct samples* samples, unsigned char* dict, unsigned long dict_size)
+{
+	unsigned long* freq;
+	unsigned long* last;
+	unsigned long epochs, epoch_size, epoch;
+	unsigned long start, end, pos, best_pos, filled = 0;
+	unsigned long score, best_score;
+	unsigned long s, p;
+
+	/* not enough data to choose from: take all of it */
+	if (samples->size <= dict_size) {
+		memcpy(dict + dict_size - samples->size, samples->data, samples->size);
+		return samples->size;
+	}
+
+	freq = (unsigned long*)calloc(FREQ_SIZE, sizeof(unsigned long));
+	last = (unsigned long*)calloc(FREQ_SIZE, sizeof(unsigned long));
+	if (!freq || !last) {
+		free(freq);
+		free(last);
+		printf("Error: not enough memory!\n");
+		return 0;
+	}
+
+	for (s = 0, p = 0; s < samples->count; p = samples->ends[s++]) {
+		for (; p + DMER_SIZE <= samples->ends[s]; p++) {
+			unsigned long h = dmer_hash(samples->data + p);
+
+			if (last[h] != s + 1) {
+				last[h] = s + 1;
+				freq[h]++;
+			}
+		}
+	}
+
+	epochs = dict_size / SEGMENT_SIZE;
+	epoch_size = samples->size / epochs;
+
+	for (epoch = 0; epoch < epochs && epoch_size >= SEGMENT_SIZE; epoch++) {
+		start = epoch * epoch_size;
+		end = start + epoch_size;
+
+		/* sliding sum over the d-mers of each segment */
+		score = 0;
+		for (pos = start; pos <= start + SEGMENT_SIZE - DMER_SIZE; pos++)
+			score += freq[dmer_hash(samples->data + pos)];
+		best_score = score;
+		best_pos = start;
+
+		for (pos = start + 1; pos + SEGMENT_SIZE <= end; pos++) {
+			score -= freq[dmer_hash(samples->data + pos - 1)];
+			score += freq[dmer_hash(samples->data + pos + SEGMENT_SIZE - DMER_SIZE)];
+			if (score > best_score) {
+				best_score = score;
+				best_pos = pos;
+			}
+		}
+
+		/* a segment that only holds unique content is not worth it */
+		if (best_score <= SEGMENT_SIZE - DMER_SIZE + 1)
+			continue;
+
+		for (pos = best_pos; pos <= best_pos + SEGMENT_SIZE - DMER_SIZE; pos++)
+			freq[dmer_hash(samples->data + pos)] = 0;
+
+		memcpy(dict + dict_size - filled - SEGMENT_SIZE, samples->data + best_pos, SEGMENT_SIZE);
+		filled += SEGMENT_SIZE;
+	}
+
+	free(freq);
+	free(last);
+
+	return filled;
+}
+
+int make_dictionary(const char* sample_dir, const char* output_file, unsigned long dict_size)
+{
+	FILE* file;
+	struct samples samples;
+	unsigned char dict[LZ77_WINDOW_SIZE];
+	unsigned long size;
+	int result = -1;
+
+	file = fopen(output_file, "rb");
+	if (file) {
+		printf("Error: file %s already exists. Aborted.\n\n", output_file);
+		fclose(file);
+		return -1;
+	}
+
+	memset(&samples, 0, sizeof(samples));
+	samples.data = (unsigned char*)malloc(MAX_SAMPLES_SIZE);
+	if (!samples.data) {
+		printf("Error: not enough memory!\n");
+		return -1;
+	}
+
+	if (load_samples(&samples, sample_dir) == 0) {
+		size = train_dictionary(&samples, dict, dict_size);
+		if (size == 0) {
+			printf("Error: no usable samples in %s\n", sample_dir);
+		} else {
+			file = fopen(output_file, "wb");
+			if (!file) {
+				printf("Error: could not create %s. Aborted.\n\n", output_file);
+			} else {
+				fwrite(dict + dict_size - size, 1, size, file);
+				fclose(file);
+				printf("%lu samples, %lu bytes -> dictionary of %lu bytes\n", samples.count, samples.size, size);
+				result = 0;
+			}
+		}
+	}
+
+	free(samples.data);
+	free(samples.ends);
+
+	return result;
+}
+
+void usage(void)
+{
+	printf("phydict: train a preset dictionary for lz77_compress_dict\n");
+	printf("\n");
+	printf("Usage: phydict [options] sample-directory dictionary-file\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -s N  dictionary size in bytes (default and maximum %d)\n", LZ77_WINDOW_SIZE);
+	printf("  -v    show program version\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	char *sample_dir = NULL;
+	char *output_file = NULL;
+	long dict_size = LZ77_WINDOW_SIZE;
+
+	if (argc == 1) {
+		usage();
+		return 0;
+	}
+
+	for (i = 1; i <= argc; i++) {
+		char* argument = argv[i];
+
+		if (!argument)
+			continue;
+
+		if (!strcmp(argument, "-h") || !strcmp(argument, "--help")) {
+			usage();
+			return 0;
+		}
+
+		if (!strcmp(argument, "-v") || !strcmp(argument, "--version")) {
+			printf("phydict: train a preset dictionary for lz77_compress_dict\n");
+			printf("Version %s (using LZ77 %s)\n", PHYZIP_VERSION_STRING, LZ77_VERSION_STRING);
+			printf("\n");
+			return 0;
+		}
+
+		if (!strncmp(argument, "-s", 2)) {
+			const char* value = argument[2] ? argument + 2 : argv[++i];
+
+			dict_size = value ? atol(value) : 0;
+			if (dict_size < SEGMENT_SIZE || dict_size > LZ77_WINDOW_SIZE) {
+				printf("Error: dictionary size must be between %d and %d\n\n", SEGMENT_SIZE, LZ77_WINDOW_SIZE);
+				return -1;
+			}
+			continue;
+		}
+
+		/* unknown option */
+		if (argument[0] == '-') {
+			printf("Error: unknown option %s\n\n", argument);
+			printf("To get help on usage:\n");
+			printf("  phydict --help\n\n");
+			return -1;
+		}
+
+		/* first specified path is the sample directory */
+		if (!sample_dir) {
+			sample_dir = argument;
+			continue;
+		}
+
+		/* next specified file is output */
+		if (!output_file) {
+			output_file = argument;
+			continue;
+		}
+	}
+
+	if (!sample_dir || !output_file) {
+		usage();
+		return -1;
+	}
+
+	return make_dictionary(sample_dir, output_file, dict_size);
+}
@@ -1,127 +1,1656 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lz77.h"
+#include "checksum.h"
+#include "stdout_stream.h"
+
+#define LZ77_VERSION_STRING "1.0"
+#define PHYZIP_VERSION_STRING "1.2.3"
+
+#define BLOCK_SIZE 65536
+
+/* upper bound of worker threads */
+#define MAX_THREADS 256
+
+/* chunk id of a solid block, the data of several small files in one chunk */
+#define SOLID_CHUNK_ID 18
+
+/* chunk id of a reference to data of an earlier file (phyzip --dedup) */
+#define REFERENCE_CHUNK_ID 19
+
+/* chunk ids of the seekable index and of its fixed-size trailer */
+#define INDEX_CHUNK_ID 32
+#define TRAILER_CHUNK_ID 33
+
+/* file header options: the data of the file is part of the next solid block */
+#define FILE_SOLID 1
+
+/* file header options: the archive may hold reference chunks (--dedup) */
+#define FILE_DEDUP 2
+
+/* data chunk options: low byte is the codec, high byte holds flags (more in checksum.h) */
+#define CHUNK_STORED 0
+#define CHUNK_LZ77 1
+#define CHUNK_LZ77_V2 2
+#define CHUNK_LZ77_HUFF 3
+#define CHUNK_LINKED 0x100
+
+/* file size recorded by phyzip for input of unknown length */
+#define STREAM_SIZE ((unsigned long)-1)
+
+/* magic identifier for phyzip file */
+static unsigned char phyzip_magic[8] = {'$', 'p', 'h', 'y', 'z', 'i', 'p', '$'};
+
+int detect_magic(FILE* file)
+{
+	unsigned char buffer[8];
+	size_t bytes_read;
+	int c;
+
+	fseek(file, SEEK_SET, 0);
+	bytes_read = fread(buffer, 1, 8, file);
+	fseek(file, SEEK_SET, 0);
+
+	if (bytes_read < 8)
+		return 0;
+
+	for (c = 0; c < 8; c++)
+		if (buffer[c] != phyzip_magic[c])
+			return 0;
+
+	return -1;
+}
+
+static unsigned long readU16(const unsigned char* p)
+{
+	return p[0] + (p[1] << 8);
+}
+
+static unsigned long readU32(const unsigned char* p)
+{
+	return p[0] + (p[1] << 8) + (p[2] << 16) + ((unsigned long)p[3] << 24);
+}
+
+static unsigned long readU64(const unsigned char* p)
+{
+	return readU32(p) + ((readU32(p + 4) << 16) << 16);
+}
+
+void parse_chunk_header(const unsigned char* buffer, int* id, int* options, unsigned long* size, unsigned long* checksum, unsigned long* extra)
+{
+	*id = readU16(buffer) & 0xffff;
+	*options = readU16(buffer + 2) & 0xffff;
+	*size = readU32(buffer + 4) & 0xffffffff;
+	*checksum = readU32(buffer + 8) & 0xffffffff;
+	*extra = readU32(buffer + 12) & 0xffffffff;
+}
+
+/* returns 0 at the end of the file */
+int read_chunk_header(FILE* file, int* id, int* options, unsigned long* size, unsigned long* checksum, unsigned long* extra)
+{
+	unsigned char buffer[16];
+
+	if (fread(buffer, 1, 16, file) != 16)
+		return 0;
+
+	parse_chunk_header(buffer, id, options, size, checksum, extra);
+
+	return 1;
+}
+
+/* scratch space for the decoded streams of Huffman chunks, grown as needed */
+struct huff_scratch {
+	unsigned char* buffer;
+	unsigned long size;
+};
+
+/*
+ * Decode one data chunk of `maxout` bytes and return where its data is:
+ * `output`, or `input` itself for a stored chunk. Returns NULL on failure.
+ * Linked chunks continue the given stream.
+ */
+static const unsigned char* decompress_chunk(lz77_stream* stream, struct huff_scratch* scratch, int options,
+	const unsigned char* input, unsigned long size, unsigned char* output, unsigned long maxout)
+{
+	unsigned long result;
+
+	switch (options & 255) {
+		case CHUNK_STORED:
+			return size == maxout && !(options & CHUNK_LINKED) ? input : NULL;
+		case CHUNK_LZ77:
+		case CHUNK_LZ77_V2:
+			break;
+		case CHUNK_LZ77_HUFF:
+			if (options & CHUNK_LINKED)
+				return NULL;
+			if (scratch->size < LZ77_HUFF_SCRATCH(maxout)) {
+				free(scratch->buffer);
+				scratch->size = LZ77_HUFF_SCRATCH(maxout);
+				scratch->buffer = (unsigned char*)malloc(scratch->size);
+				if (!scratch->buffer) {
+					scratch->size = 0;
+					return NULL;
+				}
+			}
+			result = lz77_huff_decode(input, size, output, maxout, scratch->buffer);
+			return result == maxout ? output : NULL;
+		default:
+			/* unknown codec */
+			return NULL;
+	}
+
+	if (options & CHUNK_LINKED)
+		result = lz77_decompress_continue(stream, input, size, output, maxout);
+	else
+		/* the format version is detected from the chunk data */
+		result = lz77_decompress(input, size, output, maxout);
+
+	return result == maxout ? output : NULL;
+}
+
+/*
+ * Check a data chunk against the checksum of its header: the chunk data is
+ * checked before decoding, or with CHUNK_RAW_CHECKSUM the decoded data after.
+ */
+static int check_data(int options, const unsigned char* data, unsigned long size, unsigned long expected)
+{
+	unsigned long checksum = chunk_data_checksum(options, data, size);
+
+	if (checksum != expected) {
+		printf("\nError: checksum mismatch. Skipped.\n");
+		printf("Got %08lX Expecting %08lX\n", checksum, expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the name in a file header chunk (id 1), to be freed by the caller */
+static char* header_name(const unsigned char* buffer, unsigned long chunk_size)
+{
+	int file_name_length;
+	char* name;
+
+	file_name_length = (int)readU16(buffer + 8);
+	if (file_name_length > (int)chunk_size - 10)
+		file_name_length = chunk_size - 10;
+
+	name = (char*)malloc(file_name_length + 1);
+	if (name) {
+		memcpy(name, buffer + 10, file_name_length);
+		name[file_name_length] = 0;
+	}
+
+	return name;
+}
+
+/* archived names are relative paths that stay below the current directory */
+static int safe_name(const char* name)
+{
+	const char* p = name;
+
+	if (!*name || *name == '/')
+		return 0;
+
+	while (p) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || !p[2]))
+			return 0;
+		p = strchr(p, '/');
+		if (p)
+			p++;
+	}
+
+	return 1;
+}
+
+/* create the directories leading to a file, like mkdir -p */
+static void make_parent_dirs(char* name)
+{
+	char* p;
+
+	for (p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		if (p > name && mkdir(name, 0777) != 0 && errno != EEXIST)
+			printf("Can't create directory %s.\n", name);
+		*p = '/';
+	}
+}
+
+/* create an output file and the directories it is in, fopen() mode "wb" or "w+b" */
+static FILE* open_output_file(char* output_file_name, const char* mode)
+{
+	FILE* out;
+
+	if (!safe_name(output_file_name)) {
+		printf("File name %s is not safe to extract. Skipped.\n", output_file_name);
+		return NULL;
+	}
+	make_parent_dirs(output_file_name);
+
+	/* check if already exists */
+	out = fopen(output_file_name, "rb");
+	if (out) {
+		printf("File %s already exists. Skipped.\n", output_file_name);
+		fclose(out);
+		return NULL;
+	}
+
+	/* create the file */
+	out = fopen(output_file_name, mode);
+	if (!out) {
+		printf("Can't create file %s. Skipped.\n", output_file_name);
+		return NULL;
+	}
+
+	return out;
+}
+
+/* create the output file named by a file header chunk (id 1) */
+FILE* create_output_file(const unsigned char* buffer, unsigned long chunk_size, char** name, const char* mode)
+{
+	*name = header_name(buffer, chunk_size);
+	if (!*name) {
+		printf("Error: not enough memory!\n");
+		return NULL;
+	}
+
+	return open_output_file(*name, mode);
+}
+
+/* a file is selected if it or a directory above it was named; nothing named selects all */
+static int is_selected(const char* name, char** members, int member_count)
+{
+	size_t length;
+	int c;
+
+	if (member_count == 0)
+		return 1;
+
+	for (c = 0; c < member_count; c++) {
+		length = strlen(members[c]);
+		if (!strncmp(name, members[c], length) && (!name[length] || name[length] == '/'))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* read past `size` bytes of a chunk that is not needed; a file is seeked, a pipe read */
+static int skip_bytes(FILE* in, unsigned long size)
+{
+	unsigned char buffer[4096];
+	struct stat st;
+	long pos;
+	size_t n;
+
+	if (size > sizeof(buffer) && fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && (pos = ftell(in)) >= 0) {
+		if ((unsigned long)pos + size > (unsigned long)st.st_size)
+			return -1;
+		return fseek(in, size, SEEK_CUR);
+	}
+
+	while (size > 0) {
+		n = size < sizeof(buffer) ? size : sizeof(buffer);
+		if (fread(buffer, 1, n, in) != n)
+			return -1;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/* buffers for the chunk being decoded, grown as needed */
+struct chunk_buffers {
+	unsigned char* compressed;
+	unsigned char* decompressed;
+	unsigned long compressed_size;
+	unsigned long decompressed_size;
+	struct huff_scratch scratch;
+};
+
+/*
+ * Read the data of the chunk whose header was just read, verify it and
+ * decode it. Returns the decoded data, or NULL after reporting the error.
+ */
+static const unsigned char* read_chunk_data(FILE* in, const char* input_file, struct chunk_buffers* buffers, lz77_stream* stream,
+	int options, unsigned long size, unsigned long chunk_checksum, unsigned long extra)
+{
+	const unsigned char* data;
+
+	/* enlarge input buffer if necessary */
+	if (size > buffers->compressed_size) {
+		buffers->compressed_size = size;
+		free(buffers->compressed);
+		buffers->compressed = (unsigned char*)malloc(size);
+	}
+
+	/* enlarge output buffer if necessary */
+	if (extra > buffers->decompressed_size) {
+		buffers->decompressed_size = extra;
+		free(buffers->decompressed);
+		buffers->decompressed = (unsigned char*)malloc(extra);
+	}
+
+	if (!buffers->compressed || !buffers->decompressed) {
+		buffers->compressed_size = buffers->decompressed_size = 0;
+		printf("Error: not enough memory!\n");
+		return NULL;
+	}
+
+	/* read and check checksum */
+	if (fread(buffers->compressed, 1, size, in) != size) {
+		printf("\nError: archive %s is truncated!\n", input_file);
+		return NULL;
+	}
+
+	/* verify that the chunk data is correct */
+	if (!(options & CHUNK_RAW_CHECKSUM) && check_data(options, buffers->compressed, size, chunk_checksum))
+		return NULL;
+
+	/* decompress and verify */
+	data = decompress_chunk(stream, &buffers->scratch, options, buffers->compressed, size, buffers->decompressed, extra);
+	if (!data) {
+		printf("\nError: decompression failed. Skipped.\n");
+		return NULL;
+	}
+	if ((options & CHUNK_RAW_CHECKSUM) && check_data(options, data, extra, chunk_checksum))
+		return NULL;
+
+	return data;
+}
+
+/* the files announced by FILE_SOLID headers, whose data is in the next solid block */
+struct solid_member {
+	char* name;
+	unsigned long size;
+	int selected;
+};
+
+struct solid_block {
+	struct solid_member* members;
+	unsigned long count;
+	unsigned long capacity;
+	int selected;
+};
+
+static int add_solid_member(struct solid_block* solid, char* name, unsigned long size, int selected)
+{
+	struct solid_member* members;
+
+	if (solid->count == solid->capacity) {
+		solid->capacity = solid->capacity ? solid->capacity * 2 : 64;
+		members = (struct solid_member*)realloc(solid->members, solid->capacity * sizeof(struct solid_member));
+		if (!members) {
+			printf("Error: not enough memory!\n");
+			free(name);
+			return -1;
+		}
+		solid->members = members;
+	}
+
+	solid->members[solid->count].name = name;
+	solid->members[solid->count].size = size;
+	solid->members[solid->count].selected = selected;
+	solid->count++;
+	solid->selected |= selected;
+
+	return 0;
+}
+
+static void clear_solid_block(struct solid_block* solid)
+{
+	while (solid->count > 0)
+		free(solid->members[--solid->count].name);
+	solid->selected = 0;
+}
+
+/* split a decoded solid block into the files of its headers, in order */
+static int extract_solid_block(struct solid_block* solid, const unsigned char* data, unsigned long size, FILE* to)
+{
+	struct solid_member* member;
+	unsigned long total = 0;
+	unsigned long i;
+	FILE* out;
+
+	for (i = 0; i < solid->count; i++)
+		total += solid->members[i].size;
+	if (total != size) {
+		printf("\nError: solid block does not match its file headers.\n");
+		return -1;
+	}
+
+	for (i = 0; i < solid->count; i++) {
+		member = &solid->members[i];
+		if (member->selected) {
+			out = to ? to : open_output_file(member->name, "wb");
+			if (!out)
+				return -1;
+			fwrite(data, 1, member->size, out);
+			if (out != to)
+				fclose(out);
+		}
+		data += member->size;
+	}
+
+	return 0;
+}
+
+/*
+ * Reference chunks (id 19) repeat `extra` bytes found at an offset in an
+ * earlier file, numbered by its file header from 0 on. They are copied from
+ * the file that was extracted before, or, when that is not at hand (stdout,
+ * files not selected), the data chunk they refer to is decoded once more.
+ */
+struct dedup_chunk {
+	unsigned long file;
+	unsigned long offset;
+	unsigned long extra;
+	unsigned long pos;
+};
+
+struct dedup_sources {
+	char** names;
+	unsigned long name_count;
+	unsigned long name_capacity;
+	struct dedup_chunk* chunks;
+	unsigned long chunk_count;
+	unsigned long chunk_capacity;
+};
+
+/* remember the output file of the next file number, NULL if there is none */
+static int add_source_name(struct dedup_sources* sources, const char* name)
+{
+	char** names;
+
+	if (sources->name_count == sources->name_capacity) {
+		sources->name_capacity = sources->name_capacity ? sources->name_capacity * 2 : 64;
+		names = (char**)realloc(sources->names, sources->name_capacity * sizeof(char*));
+		if (!names) {
+			printf("Error: not enough memory!\n");
+			return -1;
+		}
+		sources->names = names;
+	}
+
+	sources->names[sources->name_count] = name ? strdup(name) : NULL;
+	if (name && !sources->names[sources->name_count]) {
+		printf("Error: not enough memory!\n");
+		return -1;
+	}
+	sources->name_count++;
+
+	return 0;
+}
+
+/* remember a data chunk and where it is in the archive, -1 on a pipe */
+static int add_source_chunk(struct dedup_sources* sources, unsigned long file, unsigned long offset, unsigned long extra, long pos)
+{
+	struct dedup_chunk* chunks;
+
+	if (sources->chunk_count == sources->chunk_capacity) {
+		sources->chunk_capacity = sources->chunk_capacity ? sources->chunk_capacity * 2 : 1024;
+		chunks = (struct dedup_chunk*)realloc(sources->chunks, sources->chunk_capacity * sizeof(struct dedup_chunk));
+		if (!chunks) {
+			printf("Error: not enough memory!\n");
+			return -1;
+		}
+		sources->chunks = chunks;
+	}
+
+	sources->chunks[sources->chunk_count].file = file;
+	sources->chunks[sources->chunk_count].offset = offset;
+	sources->chunks[sources->chunk_count].extra = extra;
+	sources->chunks[sources->chunk_count].pos = (unsigned long)pos;
+	sources->chunk_count++;
+
+	return 0;
+}
+
+static void free_sources(struct dedup_sources* sources)
+{
+	while (sources->name_count > 0)
+		free(sources->names[--sources->name_count]);
+	free(sources->names);
+	free(sources->chunks);
+}
+
+/* copy from an extracted file, 0 if it is complete there */
+static int copy_extracted(const char* name, unsigned long offset, unsigned char* output, unsigned long size)
+{
+	FILE* source;
+	int result = -1;
+
+	source = fopen(name, "rb");
+	if (source) {
+		if (fseek(source, (long)offset, SEEK_SET) == 0 && fread(output, 1, size, source) == size)
+			result = 0;
+		fclose(source);
+	}
+
+	return result;
+}
+
+/* decode the data chunk at `pos` of the archive again, and come back */
+static const unsigned char* decode_source_chunk(FILE* in, const char* input_file, struct chunk_buffers* buffers, lz77_stream* stream,
+	unsigned long pos, unsigned long extra)
+{
+	const unsigned char* data = NULL;
+	long back = ftell(in);
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+
+	if (back < 0 || fseek(in, (long)pos, SEEK_SET) != 0)
+		return NULL;
+
+	if (read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra) &&
+		chunk_id == 17 && chunk_extra == extra && !(chunk_options & CHUNK_LINKED))
+		data = read_chunk_data(in, input_file, buffers, stream, chunk_options, chunk_size, chunk_checksum, chunk_extra);
+
+	if (fseek(in, back, SEEK_SET) != 0)
+		return NULL;
+
+	return data;
+}
+
+/* the data of the reference chunk whose header was just read, or NULL after reporting the error */
+static const unsigned char* resolve_reference(FILE* in, const char* input_file, struct dedup_sources* sources, struct chunk_buffers* buffers,
+	lz77_stream* stream, FILE* out, unsigned long size, unsigned long chunk_checksum, unsigned long extra)
+{
+	unsigned char payload[16];
+	unsigned long source_file;
+	unsigned long source_offset;
+	unsigned long low = 0;
+	unsigned long high = sources->chunk_count;
+	unsigned long middle;
+	struct dedup_chunk* chunk;
+	const unsigned char* data;
+
+	if (size != 16 || fread(payload, 1, 16, in) != 16 || update_adler32(1L, payload, 16) != chunk_checksum) {
+		printf("\nError: corrupted reference chunk in %s!\n", input_file);
+		return NULL;
+	}
+	source_file = readU64(payload);
+	source_offset = readU64(payload + 8);
+
+	if (extra > buffers->decompressed_size) {
+		free(buffers->decompressed);
+		buffers->decompressed = (unsigned char*)malloc(extra);
+		buffers->decompressed_size = buffers->decompressed ? extra : 0;
+		if (!buffers->decompressed) {
+			printf("Error: not enough memory!\n");
+			return NULL;
+		}
+	}
+
+	/* data chunks were recorded in archive order, which is file and offset order */
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		chunk = &sources->chunks[middle];
+		if (chunk->file < source_file || (chunk->file == source_file && chunk->offset < source_offset))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	chunk = low < sources->chunk_count ? &sources->chunks[low] : NULL;
+	if (!chunk || chunk->file != source_file || chunk->offset != source_offset || chunk->extra != extra) {
+		printf("\nError: reference chunk in %s points to no data chunk!\n", input_file);
+		return NULL;
+	}
+
+	/* the output so far, the current file included, is on disk */
+	if (source_file < sources->name_count && sources->names[source_file]) {
+		fflush(out);
+		if (copy_extracted(sources->names[source_file], source_offset, buffers->decompressed, extra) == 0)
+			return buffers->decompressed;
+	}
+
+	if (chunk->pos != (unsigned long)-1) {
+		data = decode_source_chunk(in, input_file, buffers, stream, chunk->pos, extra);
+		if (data)
+			return data;
+	}
+
+	printf("\nError: the data of a reference chunk is not available; extract from an archive file.\n");
+	return NULL;
+}
+
+/*
+ * Sequential extraction: chunks are read one after the other and the ones
+ * that are not needed are read past, so the archive may be a pipe ("-" is
+ * stdin). With `to` set, the data of all files goes there instead of to the
+ * files named by their headers. With members named, the data chunks of all
+ * other files are skipped without being verified or decoded; only a solid
+ * block that holds a selected file is decoded as a whole.
+ */
+int unpack_file(const char *input_file, FILE* to, char** members, int member_count)
+{
+	FILE *in, *out = NULL;
+	unsigned char magic[8];
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+	unsigned char buffer[BLOCK_SIZE];
+	unsigned long checksum;
+	unsigned long decompressed_size = 0;
+	struct chunk_buffers buffers;
+	struct solid_block solid;
+	struct dedup_sources sources;
+	unsigned long file_offset = 0;
+	char* output_file_name = NULL;
+	char* name;
+	const unsigned char* data;
+	lz77_stream stream;
+	long chunk_pos;
+	int result = 0;
+
+	/* sanity check */
+	in = strcmp(input_file, "-") ? fopen(input_file, "rb") : stdin;
+	if (!in) {
+		printf("Error: could not open %s\n", input_file);
+		return -1;
+	}
+
+	/* not a phyzip archive */
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, phyzip_magic, 8)) {
+		if (in != stdin)
+			fclose(in);
+		printf("Error: file %s is not a phyzip archive!\n", input_file);
+		return -1;
+	}
+
+	memset(&buffers, 0, sizeof(buffers));
+	memset(&solid, 0, sizeof(solid));
+	memset(&sources, 0, sizeof(sources));
+	lz77_stream_init(&stream);
+
+	while (result == 0 && read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra)) {
+		if ((chunk_id == 1) && (chunk_size > 10) && (chunk_size < BLOCK_SIZE)) {
+			if (fread(buffer, 1, chunk_size, in) != chunk_size) {
+				printf("\nError: archive %s is truncated!\n", input_file);
+				result = -1;
+				break;
+			}
+			checksum = update_adler32(1L, buffer, chunk_size);
+
+			if (checksum != chunk_checksum) {
+				printf("\nError: checksum mismatch!\n");
+				printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
+				result = -1;
+				break;
+			}
+
+			/* without the extracted files, references need to seek back in the archive */
+			if ((chunk_options & FILE_DEDUP) && (to || member_count > 0) && ftell(in) < 0) {
+				printf("\nError: dedup archive needs a seekable input\n");
+				result = -1;
+				break;
+			}
+
+			decompressed_size = readU64(buffer);
+			if (out && out != to)
+				fclose(out);
+			out = NULL;
+			lz77_stream_free(&stream);
+
+			name = header_name(buffer, chunk_size);
+			if (!name) {
+				printf("Error: not enough memory!\n");
+				result = -1;
+				break;
+			}
+
+			file_offset = 0;
+
+			/* the file is written when its solid block is decoded */
+			if (chunk_options & FILE_SOLID) {
+				result = add_source_name(&sources, NULL);
+				if (result == 0)
+					result = add_solid_member(&solid, name, decompressed_size, is_selected(name, members, member_count));
+				continue;
+			}
+
+			free(output_file_name);
+			output_file_name = name;
+			if (!is_selected(name, members, member_count)) {
+				result = add_source_name(&sources, NULL);
+				continue;
+			}
+
+			if (to) {
+				out = to;
+			} else {
+				out = open_output_file(output_file_name, "wb");
+				if (!out) {
+					result = -1;
+					break;
+				}
+			}
+			result = add_source_name(&sources, out == to ? NULL : output_file_name);
+			continue;
+		}
+
+		/* data chunks may be referred to later on */
+		if ((chunk_id == 17) && sources.name_count > 0) {
+			chunk_pos = ftell(in);
+			chunk_pos = chunk_pos < 0 ? -1 : chunk_pos - 16;
+			if (add_source_chunk(&sources, sources.name_count - 1, file_offset, chunk_extra, chunk_pos)) {
+				result = -1;
+				break;
+			}
+		}
+		if (chunk_id == 17 || chunk_id == REFERENCE_CHUNK_ID)
+			file_offset += chunk_extra;
+
+		if ((chunk_id == 17) && out && decompressed_size) {
+			data = read_chunk_data(in, input_file, &buffers, &stream, chunk_options, chunk_size, chunk_checksum, chunk_extra);
+			if (!data) {
+				result = -1;
+				break;
+			}
+			fwrite(data, 1, chunk_extra, out);
+			continue;
+		}
+
+		if ((chunk_id == REFERENCE_CHUNK_ID) && out && decompressed_size) {
+			data = resolve_reference(in, input_file, &sources, &buffers, &stream, out, chunk_size, chunk_checksum, chunk_extra);
+			if (!data) {
+				result = -1;
+				break;
+			}
+			fwrite(data, 1, chunk_extra, out);
+			continue;
+		}
+
+		if ((chunk_id == SOLID_CHUNK_ID) && solid.selected && !(chunk_options & CHUNK_LINKED)) {
+			data = read_chunk_data(in, input_file, &buffers, &stream, chunk_options, chunk_size, chunk_checksum, chunk_extra);
+			if (!data || extract_solid_block(&solid, data, chunk_extra, to)) {
+				result = -1;
+				break;
+			}
+			clear_solid_block(&solid);
+			continue;
+		}
+
+		/* any other chunk, e.g. the index, is not needed here */
+		if (chunk_id == SOLID_CHUNK_ID)
+			clear_solid_block(&solid);
+		if (skip_bytes(in, chunk_size)) {
+			printf("\nError: archive %s is truncated!\n", input_file);
+			result = -1;
+		}
+	}
+
+	/* files announced for a solid block that never came */
+	if (result == 0 && solid.count > 0) {
+		printf("\nError: archive %s is truncated!\n", input_file);
+		result = -1;
+	}
+
+	/* free allocated stuff */
+	free(buffers.compressed);
+	free(buffers.decompressed);
+	free(buffers.scratch.buffer);
+	free(output_file_name);
+	clear_solid_block(&solid);
+	free(solid.members);
+	free_sources(&sources);
+	lz77_stream_free(&stream);
+
+	/* close working files */
+	if (out && out != to)
+		fclose(out);
+	if (in != stdin)
+		fclose(in);
+
+	return result;
+}
+
+/*
+ * List the files of an archive with their sizes, reading past all data, so
+ * nothing is decoded and the archive may be a pipe.
+ */
+int list_archive(const char* input_file)
+{
+	FILE* in;
+	unsigned char magic[8];
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+	unsigned char buffer[BLOCK_SIZE];
+	unsigned long size;
+	char* name;
+	int result = 0;
+
+	in = strcmp(input_file, "-") ? fopen(input_file, "rb") : stdin;
+	if (!in) {
+		printf("Error: could not open %s\n", input_file);
+		return -1;
+	}
+
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, phyzip_magic, 8)) {
+		if (in != stdin)
+			fclose(in);
+		printf("Error: file %s is not a phyzip archive!\n", input_file);
+		return -1;
+	}
+
+	while (result == 0 && read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra)) {
+		if ((chunk_id == 1) && (chunk_size > 10) && (chunk_size < BLOCK_SIZE)) {
+			if (fread(buffer, 1, chunk_size, in) != chunk_size || update_adler32(1L, buffer, chunk_size) != chunk_checksum) {
+				printf("Error: corrupted file header in %s!\n", input_file);
+				result = -1;
+				break;
+			}
+			size = readU64(buffer);
+			name = header_name(buffer, chunk_size);
+			if (size == STREAM_SIZE)
+				printf("%12s  %s\n", "-", name ? name : "");
+			else
+				printf("%12lu  %s\n", size, name ? name : "");
+			free(name);
+			continue;
+		}
+
+		if (skip_bytes(in, chunk_size)) {
+			printf("Error: archive %s is truncated!\n", input_file);
+			result = -1;
+		}
+	}
+
+	if (in != stdin)
+		fclose(in);
+
+	return result;
+}
+
+/*
+ * Count the files of an archive from its chunk headers, and tell whether any
+ * of them is in a solid block or refers to an earlier file. Used to leave
+ * such archives to unpack_file().
+ */
+static int scan_archive(const char* input_file, unsigned long* files, int* solid)
+{
+	FILE* in;
+	unsigned long fsize;
+	unsigned long pos;
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+
+	*files = 0;
+	*solid = 0;
+
+	in = fopen(input_file, "rb");
+	if (!in)
+		return -1;
+
+	fseek(in, 0, SEEK_END);
+	fsize = ftell(in);
+
+	for (pos = 8; pos + 16 <= fsize; pos += 16 + chunk_size) {
+		fseek(in, pos, SEEK_SET);
+		if (!read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra))
+			break;
+		if (chunk_id == 1)
+			(*files)++;
+		if (chunk_id == SOLID_CHUNK_ID || chunk_id == REFERENCE_CHUNK_ID || (chunk_id == 1 && (chunk_options & FILE_SOLID)))
+			*solid = 1;
+	}
+	fclose(in);
+
+	return 0;
+}
+
+/* report an output file whose size differs from what its header announces */
+static int check_extracted(unsigned long extracted, unsigned long size, const char* name)
+{
+	if (extracted != size) {
+		printf("\nError: %s is incomplete, %lu of %lu bytes extracted.\n", name, extracted, size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* unmap and close an output file of unpack_file_mapped() */
+static void close_mapped_output(FILE* out, unsigned char* dest, unsigned long size)
+{
+	if (dest)
+		munmap(dest, size);
+	fclose(out);
+}
+
+/*
+ * Extraction through memory mappings: the archive is mapped as a whole, and
+ * every output file is sized with ftruncate() from its header and mapped as
+ * well. Chunks are verified in place and decoded straight into the mapped
+ * output, so nothing is read, seeked or written chunk by chunk. Returns 1 if
+ * the archive cannot be mapped or starts with a file of unknown size, which
+ * leaves it to unpack_file().
+ */
+int unpack_file_mapped(const char* input_file)
+{
+	FILE *in, *out = NULL;
+	unsigned long fsize;
+	unsigned long pos;
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+	unsigned long checksum;
+	unsigned long decompressed_size = 0;
+	unsigned long total_extracted = 0;
+	const unsigned char* archive;
+	const unsigned char* chunk;
+	const unsigned char* data;
+	unsigned char* dest = NULL;
+	char* output_file_name = NULL;
+	struct huff_scratch scratch = {NULL, 0};
+	lz77_stream stream;
+	void* map;
+	int result = 0;
+
+	in = fopen(input_file, "rb");
+	if (!in) {
+		printf("Error: could not open %s\n", input_file);
+		return -1;
+	}
+
+	/* find size of the file */
+	fseek(in, 0, SEEK_END);
+	fsize = ftell(in);
+	fseek(in, 0, SEEK_SET);
+
+	/* not a phyzip archive */
+	if (!detect_magic(in)) {
+		fclose(in);
+		printf("Error: file %s is not a phyzip archive!\n", input_file);
+		return -1;
+	}
+
+	map = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+	if (map == MAP_FAILED) {
+		fclose(in);
+		return 1;
+	}
+	archive = (const unsigned char*)map;
+
+	/* streamed input: the output cannot be sized up front */
+	if (fsize >= 8 + 16 + 10 && readU16(archive + 8) == 1 && readU64(archive + 8 + 16) == STREAM_SIZE) {
+		munmap(map, fsize);
+		fclose(in);
+		return 1;
+	}
+
+	posix_madvise(map, fsize, POSIX_MADV_SEQUENTIAL);
+	lz77_stream_init(&stream);
+
+	for (pos = 8; result == 0 && pos + 16 <= fsize; pos += 16 + chunk_size) {
+		parse_chunk_header(archive + pos, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra);
+		chunk = archive + pos + 16;
+
+		if (chunk_size > fsize - pos - 16) {
+			printf("\nError: chunk at offset %lu is truncated.\n", pos);
+			result = -1;
+			break;
+		}
+
+		if ((chunk_id == 1) && (chunk_size > 10) && (chunk_size < BLOCK_SIZE)) {
+			checksum = update_adler32(1L, chunk, chunk_size);
+
+			if (checksum != chunk_checksum) {
+				printf("\nError: checksum mismatch!\n");
+				printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
+				result = -1;
+				break;
+			}
+
+			if (out) {
+				close_mapped_output(out, dest, decompressed_size);
+				out = NULL;
+				dest = NULL;
+				result = check_extracted(total_extracted, decompressed_size, output_file_name);
+				if (result)
+					break;
+			}
+
+			free(output_file_name);
+			out = create_output_file(chunk, chunk_size, &output_file_name, "w+b");
+			if (!out) {
+				result = -1;
+				break;
+			}
+
+			/* the whole file is laid out before the first chunk is decoded */
+			decompressed_size = readU64(chunk);
+			total_extracted = 0;
+			if (decompressed_size == STREAM_SIZE) {
+				printf("Error: %s was compressed from a stream, extract it without -m\n", output_file_name);
+				fclose(out);
+				out = NULL;
+				result = -1;
+				break;
+			}
+			if (decompressed_size > 0) {
+				map = MAP_FAILED;
+				if (ftruncate(fileno(out), decompressed_size) == 0)
+					map = mmap(NULL, decompressed_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out), 0);
+				if (map == MAP_FAILED) {
+					printf("Error: could not map %s\n", output_file_name);
+					fclose(out);
+					out = NULL;
+					result = -1;
+					break;
+				}
+				dest = (unsigned char*)map;
+			}
+			lz77_stream_free(&stream);
+		}
+
+		if ((chunk_id == 17) && out && dest) {
+			if (chunk_extra > decompressed_size - total_extracted) {
+				printf("\nError: %s holds more data than its header announces.\n", input_file);
+				result = -1;
+				break;
+			}
+
+			if (!(chunk_options & CHUNK_RAW_CHECKSUM) && check_data(chunk_options, chunk, chunk_size, chunk_checksum)) {
+				result = -1;
+				break;
+			}
+
+			/* decoded in place; only stored chunks are copied */
+			data = decompress_chunk(&stream, &scratch, chunk_options, chunk, chunk_size, dest + total_extracted, chunk_extra);
+			if (!data) {
+				printf("\nError: decompression failed. Skipped.\n");
+				result = -1;
+				break;
+			}
+			if (data != dest + total_extracted)
+				memcpy(dest + total_extracted, data, chunk_extra);
+			if ((chunk_options & CHUNK_RAW_CHECKSUM) && check_data(chunk_options, dest + total_extracted, chunk_extra, chunk_checksum)) {
+				result = -1;
+				break;
+			}
+			total_extracted += chunk_extra;
+		}
+	}
+
+	if (out) {
+		close_mapped_output(out, dest, decompressed_size);
+		if (result == 0)
+			result = check_extracted(total_extracted, decompressed_size, output_file_name);
+	}
+
+	/* free allocated stuff */
+	free(output_file_name);
+	free(scratch.buffer);
+	lz77_stream_free(&stream);
+	munmap((void*)archive, fsize);
+	fclose(in);
+
+	return result;
+}
+
+/*
+ * Parallel extraction: the headers are scanned once to build a job list in
+ * which each data chunk already knows its output offset (the sum of the
+ * preceding chunk_extra values). Workers then read, verify and decompress
+ * chunks independently and place the result with pwrite(). A job without an
+ * output (fd -1) is only verified and decoded, which is what -t does.
+ */
+struct unpack_job {
+	unsigned long pos;
+	unsigned long size;
+	unsigned long checksum;
+	unsigned long extra;
+	unsigned long offset;
+	unsigned long file;
+	int options;
+	int fd;
+};
+
+struct unpack_pool {
+	int archive;
+	struct unpack_job* jobs;
+	unsigned long job_count;
+	unsigned long next_job;
+	int linked;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static void* unpack_worker(void* arg)
+{
+	struct unpack_pool* pool = (struct unpack_pool*)arg;
+	struct unpack_job* job;
+	unsigned long compressed_bufsize = 0;
+	unsigned long decompressed_bufsize = 0;
+	unsigned char* compressed_buffer = NULL;
+	unsigned char* decompressed_buffer = NULL;
+	struct huff_scratch scratch = {NULL, 0};
+	const char* error;
+	const unsigned char* data;
+	lz77_stream stream;
+	unsigned long last_file = 0;
+
+	/* linked chunks only ever reach a single worker, in archive order */
+	lz77_stream_init(&stream);
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->failed || pool->next_job >= pool->job_count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next_job++];
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job->file != last_file) {
+			lz77_stream_free(&stream);
+			last_file = job->file;
+		}
+
+		/* enlarge buffers if necessary */
+		if (job->size > compressed_bufsize) {
+			compressed_bufsize = job->size;
+			free(compressed_buffer);
+			compressed_buffer = (unsigned char*)malloc(compressed_bufsize);
+		}
+		if (job->extra > decompressed_bufsize) {
+			decompressed_bufsize = job->extra;
+			free(decompressed_buffer);
+			decompressed_buffer = (unsigned char*)malloc(decompressed_bufsize);
+		}
+
+		error = NULL;
+		if (!compressed_buffer || !decompressed_buffer) {
+			error = "not enough memory";
+		} else if (pread(pool->archive, compressed_buffer, job->size, job->pos + 16) != (ssize_t)job->size) {
+			error = "reading archive failed";
+		} else if (!(job->options & CHUNK_RAW_CHECKSUM) && chunk_data_checksum(job->options, compressed_buffer, job->size) != job->checksum) {
+			error = "checksum mismatch";
+		} else if (!(data = decompress_chunk(&stream, &scratch, job->options, compressed_buffer, job->size, decompressed_buffer, job->extra))) {
+			error = "decompression failed";
+		} else if ((job->options & CHUNK_RAW_CHECKSUM) && chunk_data_checksum(job->options, data, job->extra) != job->checksum) {
+			error = "checksum mismatch";
+		} else if (job->fd >= 0 && pwrite(job->fd, data, job->extra, job->offset) != (ssize_t)job->extra) {
+			error = "writing output failed";
+		}
+
+		if (error) {
+			pthread_mutex_lock(&pool->lock);
+			if (!pool->failed)
+				printf("\nError: %s at chunk offset %lu.\n", error, job->pos);
+			pool->failed = 1;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+	}
+
+	free(compressed_buffer);
+	free(decompressed_buffer);
+	free(scratch.buffer);
+	lz77_stream_free(&stream);
+
+	return NULL;
+}
+
+/* append a job for the chunk at pos, or NULL when out of memory */
+static struct unpack_job* add_unpack_job(struct unpack_pool* pool, unsigned long* capacity, unsigned long pos,
+	int options, unsigned long size, unsigned long checksum, unsigned long extra)
+{
+	struct unpack_job* jobs;
+	struct unpack_job* job;
+
+	if (pool->job_count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 1024;
+		jobs = (struct unpack_job*)realloc(pool->jobs, *capacity * sizeof(struct unpack_job));
+		if (!jobs) {
+			printf("Error: not enough memory!\n");
+			return NULL;
+		}
+		pool->jobs = jobs;
+	}
+
+	job = &pool->jobs[pool->job_count++];
+	job->pos = pos;
+	job->size = size;
+	job->checksum = checksum;
+	job->extra = extra;
+	job->offset = 0;
+	job->file = 0;
+	job->options = options;
+	job->fd = -1;
+	if (options & CHUNK_LINKED)
+		pool->linked = 1;
+
+	return job;
+}
+
+/* run the jobs of the pool on up to threads workers */
+static int run_unpack_pool(struct unpack_pool* pool, int threads)
+{
+	pthread_t workers[MAX_THREADS];
+	int started = 0;
+
+	/* linked chunks depend on their predecessor: decode them in order */
+	if (pool->linked)
+		threads = 1;
+
+	while (started < threads) {
+		if (pthread_create(&workers[started], NULL, unpack_worker, pool) != 0)
+			break;
+		started++;
+	}
+
+	/* no thread at all: do the work here */
+	if (started == 0)
+		unpack_worker(pool);
+
+	while (started > 0)
+		pthread_join(workers[--started], NULL);
+
+	return pool->failed ? -1 : 0;
+}
+
+/* check that the chunks of an archive of `fsize` bytes end exactly at its end */
+static int check_chunk_sizes(FILE* in, const char* input_file, unsigned long fsize)
+{
+	unsigned long pos;
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+
+	for (pos = 8; pos + 16 <= fsize; pos += 16 + chunk_size) {
+		if (fseek(in, pos, SEEK_SET) != 0 || !read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra) ||
+			chunk_size > fsize - pos - 16)
+			break;
+	}
+
+	if (pos != fsize) {
+		printf("Error: archive %s is truncated!\n", input_file);
+		return -1;
+	}
+
+	return 0;
+}
+
+int unpack_file_parallel(const char *input_file, int threads)
+{
+	FILE *in;
+	FILE *outs[MAX_THREADS];
+	int out_count = 0;
+	unsigned long fsize;
+	unsigned long pos;
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+	unsigned char buffer[BLOCK_SIZE];
+	unsigned long checksum;
+	unsigned long offset = 0;
+	unsigned long job_capacity = 0;
+	char* output_file_name = NULL;
+	struct unpack_pool pool;
+	struct unpack_job* job;
+	int result = 0;
+
+	in = fopen(input_file, "rb");
+	if (!in) {
+		printf("Error: could not open %s\n", input_file);
+		return -1;
+	}
+
+	/* find size of the file */
+	fseek(in, 0, SEEK_END);
+	fsize = ftell(in);
+	fseek(in, 0, SEEK_SET);
 
-#include "lz77.h"
+	/* not a phyzip archive */
+	if (!detect_magic(in)) {
+		fclose(in);
+		printf("Error: file %s is not a phyzip archive!\n", input_file);
+		return -1;
+	}
 
-#define LZ77_VERSION_STRING "1.0"
-#define PHYZIP_VERSION_STRING "1.2.3"
+	pool.archive = fileno(in);
+	pool.jobs = NULL;
+	pool.job_count = 0;
+	pool.next_job = 0;
+	pool.linked = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
 
-#define BLOCK_SIZE 65536
+	/* a truncated archive fails before any file is created */
+	result = check_chunk_sizes(in, input_file, fsize);
 
-/* magic identifier for phyzip file */
-static unsigned char phyzip_magic[8] = {'$', 'p', 'h', 'y', 'z', 'i', 'p', '$'};
+	/* scan all chunk headers once */
+	for (pos = 8; result == 0 && pos + 16 <= fsize; pos += 16 + chunk_size) {
+		fseek(in, pos, SEEK_SET);
+		if (!read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra) ||
+			chunk_size > fsize - pos - 16) {
+			printf("Error: archive %s is truncated!\n", input_file);
+			result = -1;
+			break;
+		}
 
-int detect_magic(FILE* file)
+		if ((chunk_id == 1) && (chunk_size > 10) && (chunk_size < BLOCK_SIZE)) {
+			if (fread(buffer, 1, chunk_size, in) != chunk_size) {
+				printf("Error: archive %s is truncated!\n", input_file);
+				result = -1;
+				break;
+			}
+			checksum = update_adler32(1L, buffer, chunk_size);
+
+			if (checksum != chunk_checksum) {
+				printf("\nError: checksum mismatch!\n");
+				printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
+				result = -1;
+				break;
+			}
+
+			if (out_count == MAX_THREADS) {
+				printf("Error: too many files in %s\n", input_file);
+				result = -1;
+				break;
+			}
+
+			free(output_file_name);
+			outs[out_count] = create_output_file(buffer, chunk_size, &output_file_name, "wb");
+			if (!outs[out_count]) {
+				result = -1;
+				break;
+			}
+			out_count++;
+			offset = 0;
+		}
+
+		if ((chunk_id == 17) && out_count > 0) {
+			job = add_unpack_job(&pool, &job_capacity, pos, chunk_options, chunk_size, chunk_checksum, chunk_extra);
+			if (!job) {
+				result = -1;
+				break;
+			}
+			job->offset = offset;
+			job->file = out_count;
+			job->fd = fileno(outs[out_count - 1]);
+			offset += chunk_extra;
+		}
+	}
+
+	if (result == 0)
+		result = run_unpack_pool(&pool, threads);
+
+	/* free allocated stuff */
+	free(pool.jobs);
+	free(output_file_name);
+	pthread_mutex_destroy(&pool.lock);
+
+	/* close working files */
+	while (out_count > 0)
+		fclose(outs[--out_count]);
+	fclose(in);
+
+	return result;
+}
+
+/*
+ * Integrity test: the chunk headers are scanned like for the parallel
+ * extraction, checking that the data chunks of each file add up to the size
+ * in its header, that each solid block holds exactly its files and that each
+ * reference points at an earlier data chunk of its size. Then the
+ * workers read, verify and decode every chunk into their own scratch buffers,
+ * and nothing is written.
+ */
+static int check_file_size(const char* name, unsigned long size, unsigned long found)
 {
-	unsigned char buffer[8];
-	size_t bytes_read;
-	int c;
+	if (name && size != STREAM_SIZE && found != size) {
+		printf("Error: %s holds %lu bytes, expecting %lu.\n", name, found, size);
+		return -1;
+	}
 
-	fseek(file, SEEK_SET, 0);
-	bytes_read = fread(buffer, 1, 8, file);
-	fseek(file, SEEK_SET, 0);
+	return 0;
+}
 
-	if (bytes_read < 8)
-		return 0;
+/*
+ * Check the reference chunk whose header was just read: its payload, and
+ * that an earlier data chunk of the same size holds what it refers to. Data
+ * jobs are in file and offset order, and solid blocks sort after their files.
+ */
+static int check_reference(FILE* in, const struct unpack_pool* pool, unsigned long size, unsigned long chunk_checksum, unsigned long extra)
+{
+	unsigned char payload[16];
+	unsigned long source_file;
+	unsigned long source_offset;
+	unsigned long low = 0;
+	unsigned long high = pool->job_count;
+	unsigned long middle;
+	const struct unpack_job* job;
 
-	for (c = 0; c < 8; c++)
-		if (buffer[c] != phyzip_magic[c])
-			return 0;
+	if (size != 16 || fread(payload, 1, 16, in) != 16 || update_adler32(1L, payload, 16) != chunk_checksum)
+		return -1;
+	source_file = readU64(payload) + 1;
+	source_offset = readU64(payload + 8);
 
-	return -1;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		job = &pool->jobs[middle];
+		if (job->file < source_file || (job->file == source_file && job->offset < source_offset))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	job = low < pool->job_count ? &pool->jobs[low] : NULL;
+	if (!job || job->file != source_file || job->offset != source_offset || job->extra != extra || (job->options & CHUNK_LINKED))
+		return -1;
+
+	return 0;
 }
 
-/* for Adler-32 checksum algorithm, see RFC 1950 Section 8.2 */
-#define ADLER32_BASE 65521
-static unsigned long update_adler32(unsigned long checksum, const void* buf, int len)
+int test_archive(const char* input_file, int threads)
 {
-	const unsigned char* ptr = (const unsigned char*)buf;
-	unsigned long s1 = checksum & 0xffff;
-	unsigned long s2 = (checksum >> 16) & 0xffff;
+	FILE* in;
+	unsigned long fsize;
+	unsigned long pos;
+	int chunk_id;
+	int chunk_options;
+	unsigned long chunk_size;
+	unsigned long chunk_checksum;
+	unsigned long chunk_extra;
+	unsigned char buffer[BLOCK_SIZE];
+	unsigned long files = 0;
+	unsigned long size = STREAM_SIZE;
+	unsigned long offset = 0;
+	unsigned long solid_size = 0;
+	unsigned long total = 0;
+	unsigned long job_capacity = 0;
+	char* name = NULL;
+	struct unpack_pool pool;
+	struct unpack_job* job;
+	int result = 0;
+
+	in = fopen(input_file, "rb");
+	if (!in) {
+		printf("Error: could not open %s\n", input_file);
+		return -1;
+	}
+
+	fseek(in, 0, SEEK_END);
+	fsize = ftell(in);
+	fseek(in, 0, SEEK_SET);
+
+	if (!detect_magic(in)) {
+		fclose(in);
+		printf("Error: file %s is not a phyzip archive!\n", input_file);
+		return -1;
+	}
+
+	pool.archive = fileno(in);
+	pool.jobs = NULL;
+	pool.job_count = 0;
+	pool.next_job = 0;
+	pool.linked = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	for (pos = 8; pos + 16 <= fsize; pos += 16 + chunk_size) {
+		fseek(in, pos, SEEK_SET);
+		read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra);
+
+		if (chunk_size > fsize - pos - 16)
+			break;
+
+		if (chunk_id == 1) {
+			if (chunk_size <= 10 || chunk_size >= BLOCK_SIZE || fread(buffer, 1, chunk_size, in) != chunk_size ||
+				update_adler32(1L, buffer, chunk_size) != chunk_checksum) {
+				printf("Error: corrupted file header at chunk offset %lu.\n", pos);
+				result = -1;
+				break;
+			}
+
+			/* the previous file is complete now */
+			if (check_file_size(name, size, offset)) {
+				result = -1;
+				break;
+			}
+
+			free(name);
+			name = header_name(buffer, chunk_size);
+			size = readU64(buffer);
+			offset = 0;
+			files++;
 
-	while (len > 0) {
-		unsigned k = len < 5552 ? len : 5552;
-		len -= k;
+			/* its data is in the next solid block */
+			if (chunk_options & FILE_SOLID) {
+				solid_size += size;
+				size = STREAM_SIZE;
+			}
+		}
+
+		if ((chunk_id == 17 || chunk_id == SOLID_CHUNK_ID || chunk_id == REFERENCE_CHUNK_ID) && files == 0) {
+			printf("Error: data chunk without a file header at chunk offset %lu.\n", pos);
+			result = -1;
+			break;
+		}
 
-		while (k >= 8) {
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			k -= 8;
+		if (chunk_id == SOLID_CHUNK_ID && chunk_extra != solid_size) {
+			printf("Error: solid block at chunk offset %lu holds %lu bytes, expecting %lu.\n", pos, chunk_extra, solid_size);
+			result = -1;
+			break;
 		}
 
-		while (k-- > 0) {
-			s1 += *ptr++;
-			s2 += s1;
+		/* references are not decoded, the chunk they refer to is */
+		if (chunk_id == REFERENCE_CHUNK_ID) {
+			if (check_reference(in, &pool, chunk_size, chunk_checksum, chunk_extra)) {
+				printf("Error: broken reference chunk at chunk offset %lu.\n", pos);
+				result = -1;
+				break;
+			}
+			offset += chunk_extra;
+			total += chunk_extra;
 		}
 
-		s1 = s1 % ADLER32_BASE;
-		s2 = s2 % ADLER32_BASE;
+		if (chunk_id == 17 || chunk_id == SOLID_CHUNK_ID) {
+			job = add_unpack_job(&pool, &job_capacity, pos, chunk_options, chunk_size, chunk_checksum, chunk_extra);
+			if (!job) {
+				result = -1;
+				break;
+			}
+			job->file = files;
+			job->offset = offset;
+			total += chunk_extra;
+			if (chunk_id == 17) {
+				offset += chunk_extra;
+			} else {
+				job->offset = STREAM_SIZE;
+				solid_size = 0;
+			}
+		}
 	}
 
-	return (s2 << 16) + s1;
-}
+	if (result == 0 && pos != fsize) {
+		printf("Error: archive %s is truncated!\n", input_file);
+		result = -1;
+	}
 
-static unsigned long readU16(const unsigned char* p)
-{
-	return p[0] + (p[1] << 8);
-}
+	if (result == 0 && solid_size != 0) {
+		printf("Error: solid block of the last files is missing.\n");
+		result = -1;
+	}
 
-static unsigned long readU32(const unsigned char* p)
-{
-	return p[0] + (p[1] << 8) + (p[2] << 16) + (p[3] << 24);
-}
+	if (result == 0)
+		result = check_file_size(name, size, offset);
 
-void read_chunk_header(FILE* file, int* id, int* options, unsigned long* size, unsigned long* checksum, unsigned long* extra)
-{
-	unsigned char buffer[16];
-	fread(buffer, 1, 16, file);
+	if (result == 0)
+		result = run_unpack_pool(&pool, threads);
 
-	*id = readU16(buffer) & 0xffff;
-	*options = readU16(buffer + 2) & 0xffff;
-	*size = readU32(buffer + 4) & 0xffffffff;
-	*checksum = readU32(buffer + 8) & 0xffffffff;
-	*extra = readU32(buffer + 12) & 0xffffffff;
+	if (result == 0)
+		printf("%s: OK, %lu files, %lu bytes\n", input_file, files, total);
+
+	free(pool.jobs);
+	free(name);
+	pthread_mutex_destroy(&pool.lock);
+	fclose(in);
+
+	return result;
 }
 
-int unpack_file(const char *input_file)
+/*
+ * Byte-range extraction: the trailer chunk (the last 24 bytes) points at the
+ * index chunk, which maps uncompressed offsets to data chunk positions. Only
+ * the chunks covering [offset, offset + length) are read and decompressed,
+ * and the requested bytes are written to `to`.
+ */
+int extract_range(const char* input_file, FILE* to, unsigned long offset, unsigned long length)
 {
-	FILE *in, *out;
+	FILE *in;
 	unsigned long fsize;
-	size_t pos;
 	int chunk_id;
 	int chunk_options;
 	unsigned long chunk_size;
 	unsigned long chunk_checksum;
 	unsigned long chunk_extra;
-	unsigned char buffer[BLOCK_SIZE];
-	unsigned long checksum;
-	unsigned long decompressed_size;
-	unsigned long total_extracted;
+	unsigned char trailer[8];
+	unsigned char* index = NULL;
+	unsigned long count;
+	unsigned long lo, hi, mid;
+	unsigned long chunk_offset;
+	unsigned long skip, take;
+	unsigned char* compressed_buffer = NULL;
+	unsigned char* decompressed_buffer = NULL;
 	unsigned long compressed_bufsize = 0;
 	unsigned long decompressed_bufsize = 0;
-	unsigned char* compressed_buffer;
-	unsigned char* decompressed_buffer;
-	int file_name_length;
-	char* output_file_name;
-	int c;
-	unsigned long remaining;
+	struct huff_scratch scratch = {NULL, 0};
+	const unsigned char* data;
+	lz77_stream stream;
+	int from_start = 0;
+	int result = -1;
 
-	/* sanity check */
 	in = fopen(input_file, "rb");
 	if (!in) {
 		printf("Error: could not open %s\n", input_file);
@@ -140,128 +1669,191 @@ int unpack_file(const char *input_file)
 		return -1;
 	}
 
-	/* position of first chunk */
-	fseek(in, 8, SEEK_SET);
-
-	while (1) {
-		pos = ftell(in);
-		if (pos >= fsize)
-			break;
+	lz77_stream_init(&stream);
 
-		read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra);
+	/* locate the index through the trailer */
+	if (fsize < 8 + 16 + 8 + 16 + 8) {
+		fclose(in);
+		printf("Error: archive %s has no chunk index!\n", input_file);
+		return -1;
+	}
+	fseek(in, fsize - 24, SEEK_SET);
+	read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra);
+	if (chunk_id != TRAILER_CHUNK_ID || chunk_size != 8 || fread(trailer, 1, 8, in) != 8 ||
+		update_adler32(1L, trailer, 8) != chunk_checksum || readU64(trailer) >= fsize - 24) {
+		fclose(in);
+		printf("Error: archive %s has no chunk index!\n", input_file);
+		return -1;
+	}
 
-		if ((chunk_id == 1) && (chunk_size > 10) && (chunk_size < BLOCK_SIZE)) {
-			fread(buffer, 1, chunk_size, in);
-			checksum = update_adler32(1L, buffer, chunk_size);
+	fseek(in, readU64(trailer), SEEK_SET);
+	read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra);
+	count = chunk_size / 16;
+	if (chunk_id != INDEX_CHUNK_ID || chunk_size != count * 16 || chunk_size > fsize) {
+		printf("Error: corrupted chunk index!\n");
+		goto cleanup;
+	}
 
-			if (checksum != chunk_checksum) {
-				printf("\nError: checksum mismatch!\n");
-				printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
-				fclose(in);
-				return -1;
-			}
+	index = (unsigned char*)malloc(chunk_size + 1);
+	if (!index || fread(index, 1, chunk_size, in) != chunk_size ||
+		update_adler32(1L, index, chunk_size) != chunk_checksum) {
+		printf("Error: corrupted chunk index!\n");
+		goto cleanup;
+	}
 
-			total_extracted = 0;
+	/* last chunk starting at or before offset */
+	lo = 0;
+	hi = count;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (readU64(index + mid * 16) <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-			decompressed_size = readU32(buffer);
+	for (; lo < count && length > 0; lo++) {
+		chunk_offset = readU64(index + lo * 16);
+		fseek(in, readU64(index + lo * 16 + 8), SEEK_SET);
+		read_chunk_header(in, &chunk_id, &chunk_options, &chunk_size, &chunk_checksum, &chunk_extra);
+		if (chunk_id != 17 || chunk_size > fsize) {
+			printf("Error: corrupted chunk index!\n");
+			goto cleanup;
+		}
 
-			file_name_length = (int)readU16(buffer + 8);
-			if (file_name_length > (int)chunk_size - 10)
-				file_name_length = chunk_size - 10;
+		/* a linked chunk needs every chunk before it decoded first */
+		if ((chunk_options & CHUNK_LINKED) && chunk_offset > 0 && !from_start) {
+			from_start = 1;
+			lo = (unsigned long)-1;
+			continue;
+		}
 
-			output_file_name = (char*)malloc(file_name_length + 1);
-			memset(output_file_name, 0, file_name_length + 1);
-			for (c = 0; c < file_name_length; c++)
-				output_file_name[c] = buffer[10 + c];
+		if (!(chunk_options & CHUNK_LINKED) && chunk_offset + chunk_extra <= offset)
+			continue;
 
-			/* check if already exists */
-			out = fopen(output_file_name, "rb");
-			if (out) {
-				printf("File %s already exists. Skipped.\n", output_file_name);
-				fclose(out);
-				return -1;
-			} else {
-				/* create the file */
-				out = fopen(output_file_name, "wb");
-				if (!out) {
-					printf("Can't create file %s. Skipped.\n", output_file_name);
-					return -1;
-				}
-			}
+		/* enlarge buffers if necessary */
+		if (chunk_size > compressed_bufsize) {
+			compressed_bufsize = chunk_size;
+			free(compressed_buffer);
+			compressed_buffer = (unsigned char*)malloc(compressed_bufsize);
+		}
+		if (chunk_extra > decompressed_bufsize) {
+			decompressed_bufsize = chunk_extra;
+			free(decompressed_buffer);
+			decompressed_buffer = (unsigned char*)malloc(decompressed_bufsize);
+		}
+		if (!compressed_buffer || !decompressed_buffer) {
+			printf("Error: not enough memory!\n");
+			goto cleanup;
 		}
 
-		if ((chunk_id == 17) && out && output_file_name && decompressed_size) {
-			/* enlarge input buffer if necessary */
-			if (chunk_size > compressed_bufsize) {
-				compressed_bufsize = chunk_size;
-				free(compressed_buffer);
-				compressed_buffer = (unsigned char*)malloc(compressed_bufsize);
-			}
+		if (fread(compressed_buffer, 1, chunk_size, in) != chunk_size ||
+			(!(chunk_options & CHUNK_RAW_CHECKSUM) && chunk_data_checksum(chunk_options, compressed_buffer, chunk_size) != chunk_checksum)) {
+			printf("\nError: checksum mismatch!\n");
+			goto cleanup;
+		}
 
-			/* enlarge output buffer if necessary */
-			if (chunk_extra > decompressed_bufsize) {
-				decompressed_bufsize = chunk_extra;
-				free(decompressed_buffer);
-				decompressed_buffer = (unsigned char*)malloc(decompressed_bufsize);
-			}
+		data = decompress_chunk(&stream, &scratch, chunk_options, compressed_buffer, chunk_size, decompressed_buffer, chunk_extra);
+		if (!data) {
+			printf("\nError: decompression failed!\n");
+			goto cleanup;
+		}
+		if ((chunk_options & CHUNK_RAW_CHECKSUM) && chunk_data_checksum(chunk_options, data, chunk_extra) != chunk_checksum) {
+			printf("\nError: checksum mismatch!\n");
+			goto cleanup;
+		}
 
-			/* read and check checksum */
-			fread(compressed_buffer, 1, chunk_size, in);
-			checksum = update_adler32(1L, compressed_buffer, chunk_size);
-			total_extracted += chunk_extra;
+		if (chunk_offset + chunk_extra <= offset)
+			continue;
 
-			/* verify that the chunk data is correct */
-			if (checksum != chunk_checksum) {
-				printf("\nError: checksum mismatch. Skipped.\n");
-				printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
-				return -1;
-			} else {
-				/* decompress and verify */
-				remaining = lz77_decompress(compressed_buffer, chunk_size, decompressed_buffer, chunk_extra);
-				if (remaining != chunk_extra) {
-					printf("\nError: decompression failed. Skipped.\n");
-					return -1;
-				} else {
-					fwrite(decompressed_buffer, 1, chunk_extra, out);
-				}
-			}
+		skip = offset > chunk_offset ? offset - chunk_offset : 0;
+		take = chunk_extra - skip < length ? chunk_extra - skip : length;
+		if (fwrite(data + skip, 1, take, to) != take) {
+			printf("\nError: could not write the range!\n");
+			goto cleanup;
 		}
+		offset += take;
+		length -= take;
+	}
 
-		/* position of next chunk */
-		fseek(in, pos + 16 + chunk_size, SEEK_SET);
+	/* the range starts or ends past the end of the file */
+	if (length > 0) {
+		printf("\nError: range ends %lu bytes past the end of the file!\n", length);
+		goto cleanup;
 	}
 
-	/* free allocated stuff */
+	result = 0;
+
+cleanup:
+	lz77_stream_free(&stream);
+	free(index);
 	free(compressed_buffer);
 	free(decompressed_buffer);
-	free(output_file_name);
-
-	/* close working files */
-	if (out)
-		fclose(out);
+	free(scratch.buffer);
 	fclose(in);
 
-	return 0;
+	return result;
 }
 
 void usage(void)
 {
 	printf("phyunzip: uncompress phyzip archive\n");
 	printf("\n");
-	printf("Usage: phyunzip archive-file\n");
+	printf("Usage: phyunzip [options] archive-file\n");
+	printf("       phyunzip -t archive-file...\n");
+	printf("\n");
+	printf("An archive-file of - reads stdin.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -x NAME\n");
+	printf("        extract only file NAME, or the files below directory NAME;\n");
+	printf("        may be repeated\n");
+	printf("  --list\n");
+	printf("        list the files of the archive and their sizes\n");
+	printf("  -t    test the archives: verify and decode every chunk and write\n");
+	printf("        nothing, on all processors unless -T is given\n");
+	printf("  -T N  extract with N worker threads (default 1)\n");
+	printf("  -m    extract through memory mappings of the archive and output\n");
+	printf("  -c    write the extracted data to stdout instead of files\n");
+	printf("  --range OFFSET:LEN\n");
+	printf("        write LEN bytes from OFFSET to stdout (needs phyzip -i)\n");
+	printf("  -v    show program version\n");
 	printf("\n");
 }
 
 int main(int argc, char **argv)
 {
 	int i;
-	const char* archive_file;
+	const char* archive_file = NULL;
+	int threads = 0;
+	int mapped = 0;
+	int to_stdout = 0;
+	int range = 0;
+	int list = 0;
+	int test = 0;
+	char** archives;
+	int archive_count = 0;
+	int result;
+	int solid;
+	unsigned long files;
+	char** members;
+	int member_count = 0;
+	FILE* to;
+	unsigned long range_offset = 0;
+	unsigned long range_length = 0;
 
 	if (argc == 1) {
 		usage();
 		return 0;
 	}
 
+	members = (char**)malloc(argc * sizeof(char*));
+	archives = (char**)malloc(argc * sizeof(char*));
+	if (!members || !archives) {
+		printf("Error: not enough memory!\n");
+		return -1;
+	}
+
 	for (i = 1; i <= argc; i++) {
 		char* argument = argv[i];
 
@@ -280,23 +1872,161 @@ int main(int argc, char **argv)
 			return 0;
 		}
 
-		/* unknown option */
-		if (argument[0] == '-') {
+		if (!strncmp(argument, "-T", 2)) {
+			const char* value = argument[2] ? argument + 2 : argv[++i];
+
+			threads = value ? atoi(value) : 0;
+			if (threads < 1 || threads > MAX_THREADS) {
+				printf("Error: thread count must be between 1 and %d\n\n", MAX_THREADS);
+				return -1;
+			}
+			continue;
+		}
+
+		if (!strcmp(argument, "-m") || !strcmp(argument, "--mmap")) {
+			mapped = 1;
+			continue;
+		}
+
+		if (!strcmp(argument, "-c") || !strcmp(argument, "--stdout")) {
+			to_stdout = 1;
+			continue;
+		}
+
+		if (!strncmp(argument, "-x", 2)) {
+			char* value = argument[2] ? argument + 2 : argv[++i];
+
+			if (!value || !*value) {
+				printf("Error: -x expects a file name\n\n");
+				return -1;
+			}
+			members[member_count++] = value;
+			continue;
+		}
+
+		if (!strcmp(argument, "--list")) {
+			list = 1;
+			continue;
+		}
+
+		if (!strcmp(argument, "-t") || !strcmp(argument, "--test")) {
+			test = 1;
+			continue;
+		}
+
+		if (!strcmp(argument, "--range")) {
+			char* end = NULL;
+
+			if (argv[i + 1]) {
+				range_offset = strtoul(argv[++i], &end, 0);
+				if (*end == ':')
+					range_length = strtoul(end + 1, &end, 0);
+			}
+			if (!end || *end) {
+				printf("Error: --range expects OFFSET:LEN\n\n");
+				return -1;
+			}
+			range = 1;
+			continue;
+		}
+
+		/* unknown option; a single - is stdin */
+		if (argument[0] == '-' && argument[1]) {
 			printf("Error: unknown option %s\n\n", argument);
 			printf("To get help on usage:\n");
 			printf("  phyunzip --help\n\n");
 			return -1;
 		}
 
+		/* first specified file is the archive, -t takes any number */
+		if (!archive_file)
+			archive_file = argument;
+		archives[archive_count++] = argument;
 	}
 
-	/* needs at least two arguments */
-	if (argc <= 1) {
+	/* needs an archive */
+	if (!archive_file) {
 		usage();
 		return 0;
 	}
 
-	archive_file = argv[1];
+	/* messages go to stderr, so that they do not mix with the range */
+	if (range) {
+		to = open_stdout_stream();
+		if (!to) {
+			printf("Error: could not write to stdout\n\n");
+			return -1;
+		}
+		result = extract_range(archive_file, to, range_offset, range_length);
+		if (fclose(to) != 0)
+			result = -1;
+		return result;
+	}
+
+	if (list)
+		return list_archive(archive_file);
+
+	/* testing is CPU-bound: by default use every processor */
+	if (test) {
+		if (threads == 0) {
+			long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+			threads = online < 1 ? 1 : online > MAX_THREADS ? MAX_THREADS : (int)online;
+		}
+
+		result = 0;
+		for (i = 0; i < archive_count; i++) {
+			if (!strcmp(archives[i], "-")) {
+				printf("Error: -t needs an archive file\n");
+				result = -1;
+			} else if (test_archive(archives[i], threads) != 0) {
+				result = -1;
+			}
+		}
+		return result;
+	}
+
+	if (threads == 0)
+		threads = 1;
+
+	/* the mapped extraction runs on a single thread */
+	if (mapped && threads > 1) {
+		printf("Error: -m cannot be combined with -T\n\n");
+		return -1;
+	}
+
+	/* streams are read and written in order */
+	if ((to_stdout || !strcmp(archive_file, "-")) && (threads > 1 || mapped)) {
+		printf("Error: -T and -m need an archive file and output files\n\n");
+		return -1;
+	}
+
+	/* solid blocks, references, selected files and very many files are extracted in order */
+	if (threads > 1 || mapped) {
+		if (member_count > 0 || scan_archive(archive_file, &files, &solid) != 0 || solid || (threads > 1 && files > MAX_THREADS))
+			threads = mapped = 0;
+	}
+
+	if (threads > 1)
+		return unpack_file_parallel(archive_file, threads);
+
+	if (mapped) {
+		result = unpack_file_mapped(archive_file);
+		if (result != 1)
+			return result;
+	}
+
+	if (!to_stdout)
+		return unpack_file(archive_file, NULL, members, member_count);
+
+	to = open_stdout_stream();
+	if (!to) {
+		printf("Error: could not write to stdout\n\n");
+		return -1;
+	}
+	result = unpack_file(archive_file, to, members, member_count);
+	if (fclose(to) != 0)
+		result = -1;
 
-	return unpack_file(archive_file);
+	return result;
 }
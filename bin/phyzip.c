@@ -1,13 +1,111 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lz77.h"
+#include "checksum.h"
+#include "stdout_stream.h"
 
 #define LZ77_VERSION_STRING "1.0"
 #define PHYZIP_VERSION_STRING "1.2.3"
 
 #define BLOCK_SIZE (2 * 64 * 1024)
 
+/* upper bound of worker threads, and blocks in flight per worker */
+#define MAX_THREADS 256
+#define BLOCKS_PER_THREAD 2
+
+/* chunk id of a solid block, the data of several small files in one chunk */
+#define SOLID_CHUNK_ID 18
+
+/* chunk id of a reference to a block that is already in the archive (--dedup) */
+#define REFERENCE_CHUNK_ID 19
+
+/* chunk ids of the seekable index and of its fixed-size trailer */
+#define INDEX_CHUNK_ID 32
+#define TRAILER_CHUNK_ID 33
+
+/* file header options: the data of the file is part of the next solid block */
+#define FILE_SOLID 1
+
+/* file header options: the archive may hold reference chunks (--dedup) */
+#define FILE_DEDUP 2
+
+/* files smaller than this are packed together into solid blocks */
+#define SOLID_LIMIT (32 * 1024)
+
+/* data chunk options: low byte is the codec, high byte holds flags (more in checksum.h) */
+#define CHUNK_STORED 0
+#define CHUNK_LZ77 1
+#define CHUNK_LZ77_V2 2
+#define CHUNK_LZ77_HUFF 3
+#define CHUNK_LINKED 0x100
+
+/* blocks that do not shrink by at least 1/16 are stored */
+#define STORED_LIMIT(size) ((size) - (size) / 16)
+
+/* file size recorded for input of unknown length, read from stdin */
+#define STREAM_SIZE ((unsigned long)-1)
+#define STREAM_NAME "stdin"
+
+
+struct pack_options {
+	int level;
+	int format;
+	int huff;
+	int threads;
+	int index;
+	int linked;
+	int mmap;
+	int pipeline;
+	int checks;
+	int dedup;
+};
+
+/* the file to compress, read block by block or mapped as a whole */
+struct pack_input {
+	FILE* file;
+	const unsigned char* map;
+	unsigned long size;
+	unsigned long pos;
+};
+
+/* one file of a multi-file archive, named by its path from `name` on */
+struct pack_entry {
+	char* path;
+	const char* name;
+	unsigned long size;
+};
+
+/* the files found below the inputs, and the one being read block by block */
+struct pack_tree {
+	struct pack_entry* entries;
+	unsigned long count;
+	unsigned long capacity;
+	unsigned long next;
+	FILE* file;
+	unsigned long remaining;
+	dev_t skip_dev;
+	ino_t skip_ino;
+};
+
+/* uncompressed offset and archive position of every data chunk */
+struct chunk_index {
+	unsigned long* offsets;
+	unsigned long* positions;
+	unsigned long count;
+	unsigned long capacity;
+	unsigned long total;
+	int failed;
+};
+
 /* magic identifier for phyzip file */
 static unsigned char phyzip_magic[8] = {'$', 'p', 'h', 'y', 'z', 'i', 'p', '$'};
 
@@ -60,151 +158,1091 @@ void write_chunk_header(FILE* file, int id, int options, unsigned long size, uns
 	fwrite(buffer, 16, 1, file);
 }
 
-/* for Adler-32 checksum algorithm, see RFC 1950 Section 8.2 */
-#define ADLER32_BASE 65521
-static unsigned long update_adler32(unsigned long checksum, const void* buf, int len)
+static void write_u64(unsigned char* buffer, unsigned long value)
+{
+	int c;
+
+	for (c = 0; c < 8; c++)
+		buffer[c] = (value >> (8 * c)) & 255;
+}
+
+/*
+ * File header chunk (id 1): the 64-bit file size, the 16-bit length of the
+ * name and the name with its terminating zero. A file in a solid block has
+ * FILE_SOLID in the options, every file of a --dedup archive FILE_DEDUP.
+ */
+void write_file_header(FILE* file, const char* name, unsigned long size, int options)
+{
+	unsigned char buffer[10];
+	unsigned long checksum;
+	size_t name_length = strlen(name) + 1;
+
+	write_u64(buffer, size);
+	buffer[8] = name_length & 255;
+	buffer[9] = name_length >> 8;
+
+	/*
+	 * 00000000  24 70 68 79 7a 69 70 24  01 00 00 00 0f 00 00 00  |$phyzip$........|
+	 * 00000010  a5 01 21 06 00 00 00 00  09 00 00 00 00 00 00 00  |..!.............|
+	 * 00000020  05 00 4e 6f 74 65 00                              |..Note.|
+	 */
+	checksum = 1L;
+	checksum = update_adler32(checksum, buffer, 10);
+	checksum = update_adler32(checksum, name, name_length);
+	write_chunk_header(file, 1, options, 10 + name_length, checksum, 0);
+	fwrite(buffer, 10, 1, file);
+	fwrite(name, name_length, 1, file);
+}
+
+/* write one data chunk (id 17) and remember where it went */
+void write_data_chunk(FILE* file, struct chunk_index* index, int options, const unsigned char* result, int chunk_size, unsigned long checksum, unsigned long bytes_read)
+{
+	unsigned long* offsets;
+	unsigned long* positions;
+
+	if (index && !index->failed) {
+		if (index->count == index->capacity) {
+			index->capacity = index->capacity ? index->capacity * 2 : 1024;
+			offsets = (unsigned long*)realloc(index->offsets, index->capacity * sizeof(unsigned long));
+			if (offsets)
+				index->offsets = offsets;
+			positions = (unsigned long*)realloc(index->positions, index->capacity * sizeof(unsigned long));
+			if (positions)
+				index->positions = positions;
+			if (!offsets || !positions)
+				index->failed = 1;
+		}
+		if (!index->failed) {
+			index->offsets[index->count] = index->total;
+			index->positions[index->count] = ftell(file);
+			index->count++;
+		}
+		index->total += bytes_read;
+	}
+
+	write_chunk_header(file, 17, options, chunk_size, checksum, bytes_read);
+	fwrite(result, 1, chunk_size, file);
+}
+
+/*
+ * Reference chunk (id 19): the block is the same as the `length` bytes at
+ * `source_offset` in an earlier file of the archive, numbered by its file
+ * header from 0 on. The 16-byte payload holds both, 64-bit little endian.
+ */
+void write_reference_chunk(FILE* file, unsigned long source_file, unsigned long source_offset, unsigned long length)
+{
+	unsigned char payload[16];
+
+	write_u64(payload, source_file);
+	write_u64(payload + 8, source_offset);
+	write_chunk_header(file, REFERENCE_CHUNK_ID, 0, 16, update_adler32(1L, payload, 16), length);
+	fwrite(payload, 16, 1, file);
+}
+
+/*
+ * The index chunk (id 32) holds one 16-byte entry per data chunk: the
+ * uncompressed offset and the archive position of its header, both 64-bit
+ * little endian. It is followed by the trailer chunk (id 33), whose 8-byte
+ * payload is the position of the index chunk. The trailer is always the last
+ * 24 bytes of the archive, so a reader can locate the index with one seek.
+ * Both chunks are skipped by readers that do not know them.
+ */
+int write_index(FILE* file, const struct chunk_index* index)
+{
+	unsigned char entry[16];
+	unsigned long checksum = 1L;
+	unsigned long index_pos;
+	unsigned long i;
+
+	if (index->failed) {
+		printf("Error: not enough memory for the chunk index!\n");
+		return -1;
+	}
+
+	for (i = 0; i < index->count; i++) {
+		write_u64(entry, index->offsets[i]);
+		write_u64(entry + 8, index->positions[i]);
+		checksum = update_adler32(checksum, entry, 16);
+	}
+
+	index_pos = ftell(file);
+	write_chunk_header(file, INDEX_CHUNK_ID, 0, index->count * 16, checksum, index->count);
+	for (i = 0; i < index->count; i++) {
+		write_u64(entry, index->offsets[i]);
+		write_u64(entry + 8, index->positions[i]);
+		fwrite(entry, 16, 1, file);
+	}
+
+	write_u64(entry, index_pos);
+	write_chunk_header(file, TRAILER_CHUNK_ID, 0, 8, update_adler32(1L, entry, 8), 0);
+	fwrite(entry, 8, 1, file);
+
+	return 0;
+}
+
+/*
+ * Next block of at most BLOCK_SIZE bytes: `*block` points into the mapped
+ * file, or at `buffer` after reading into it behind the `have` bytes that
+ * are already there. Returns 0 at the end.
+ */
+static size_t read_block(struct pack_input* input, unsigned char* buffer, size_t have, const unsigned char** block)
+{
+	size_t bytes_read;
+
+	if (!input->map) {
+		*block = buffer;
+		return have + fread(buffer + have, 1, BLOCK_SIZE - have, input->file);
+	}
+
+	bytes_read = input->size - input->pos < BLOCK_SIZE ? input->size - input->pos : BLOCK_SIZE;
+	*block = input->map + input->pos;
+	input->pos += bytes_read;
+
+	return bytes_read;
+}
+
+/* the checksum of a chunk, over its data or with CHUNK_RAW_CHECKSUM over the block it holds */
+static unsigned long block_checksum(int checks, const unsigned char* block, size_t length, const unsigned char* data, int chunk_size)
+{
+	if (checks & CHUNK_RAW_CHECKSUM)
+		return chunk_data_checksum(checks, block, length);
+
+	return chunk_data_checksum(checks, data, chunk_size);
+}
+
+/* the slower codecs are only tried on blocks whose first bytes compress */
+#define PROBE_SIZE (16 * 1024)
+
+/*
+ * Compress one block and return the codec for the chunk options. A quick
+ * level 1 pass that gives up early on incompressible data comes first, so
+ * such blocks are stored without spending the slower codecs on them; in
+ * front of those it only probes the first PROBE_SIZE bytes. A stored chunk
+ * holds the input itself, which is not copied to `output`.
+ * The Huffman stage codes the v1 block again through `scratch` and is only
+ * kept where it saves space; `huff` holds its flags.
+ */
+static int compress_block(lz77_cctx* ctx, int level, int format, int huff, const unsigned char* input, int length,
+	unsigned char* output, unsigned char* scratch, int* chunk_size)
+{
+	int limit = STORED_LIMIT(length);
+	int probe = length;
+
+	if ((format == CHUNK_LZ77_V2 || level > LZ77_LEVEL_MIN) && length > PROBE_SIZE)
+		probe = PROBE_SIZE;
+
+	*chunk_size = lz77_compress_limit(ctx, input, probe, output, STORED_LIMIT(probe));
+	if (*chunk_size > 0 && format == CHUNK_LZ77_V2)
+		*chunk_size = lz77_compress_v2(input, length, output);
+	else if (*chunk_size > 0 && level > LZ77_LEVEL_MIN)
+		*chunk_size = lz77_compress_level(input, length, output, level);
+
+	if (*chunk_size == 0 || *chunk_size > limit) {
+		*chunk_size = length;
+		return CHUNK_STORED;
+	}
+
+	if (format == CHUNK_LZ77_HUFF) {
+		int coded = lz77_huff_encode(output, *chunk_size, scratch, huff);
+
+		if (coded == 0 || coded >= *chunk_size)
+			return CHUNK_LZ77;
+		memcpy(output, scratch, coded);
+		*chunk_size = coded;
+	}
+
+	return format;
+}
+
+/*
+ * Deduplication (--dedup): blocks are cut where the content says, not every
+ * BLOCK_SIZE bytes. A gear hash rolls over the data, and a block ends where
+ * its top DEDUP_BITS bits are zero, at least DEDUP_MIN bytes in and at most
+ * BLOCK_SIZE. A region that recurs, even shifted or in another file, is thus
+ * cut into the same blocks again. Every block is fingerprinted, and a block
+ * seen before becomes a reference chunk instead of being compressed again.
+ */
+#define DEDUP_MIN (16 * 1024)
+#define DEDUP_BITS 15
+#define DEDUP_MASK ((((unsigned long)1 << DEDUP_BITS) - 1) << (64 - DEDUP_BITS))
+
+/* a reference chunk takes 32 bytes, so shorter blocks are not looked up */
+#define DEDUP_SHORTEST 32
+
+struct dedup_entry {
+	unsigned long fingerprint[2];
+	unsigned long length;
+	unsigned long file;
+	unsigned long offset;
+};
+
+/* the fingerprint table, and where the reader is in the input */
+struct dedup_state {
+	unsigned long gear[256];
+	struct dedup_entry* table;
+	unsigned long capacity;
+	unsigned long count;
+	unsigned char* carry;
+	size_t carry_length;
+	unsigned long file;
+	unsigned long offset;
+};
+
+static int dedup_init(struct dedup_state* dedup)
+{
+	unsigned long seed = 0;
+	unsigned long z;
+	int c;
+
+	/* fixed pseudo-random gear values (splitmix64), so archives are reproducible */
+	for (c = 0; c < 256; c++) {
+		seed += 0x9E3779B97F4A7C15UL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+		dedup->gear[c] = z ^ (z >> 31);
+	}
+
+	dedup->capacity = 4096;
+	dedup->count = 0;
+	dedup->table = (struct dedup_entry*)calloc(dedup->capacity, sizeof(struct dedup_entry));
+	dedup->carry = (unsigned char*)malloc(BLOCK_SIZE);
+	dedup->carry_length = 0;
+	dedup->file = 0;
+	dedup->offset = 0;
+
+	return dedup->table && dedup->carry ? 0 : -1;
+}
+
+static void dedup_free(struct dedup_state* dedup)
+{
+	free(dedup->table);
+	free(dedup->carry);
+}
+
+/* length of the next block of `data`: up to the first cut point, or all of it */
+static size_t dedup_cut(const struct dedup_state* dedup, const unsigned char* data, size_t length)
 {
-	const unsigned char* ptr = (const unsigned char*)buf;
-	unsigned long s1 = checksum & 0xffff;
-	unsigned long s2 = (checksum >> 16) & 0xffff;
-
-	while (len > 0) {
-		unsigned k = len < 5552 ? len : 5552;
-		len -= k;
-
-		while (k >= 8) {
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			s1 += *ptr++;
-			s2 += s1;
-			k -= 8;
-		}
-
-		while (k-- > 0) {
-			s1 += *ptr++;
-			s2 += s1;
-		}
-
-		s1 = s1 % ADLER32_BASE;
-		s2 = s2 % ADLER32_BASE;
-	}
-
-	return (s2 << 16) + s1;
+	unsigned long hash = 0;
+	size_t i;
+
+	if (length <= DEDUP_MIN)
+		return length;
+
+	/* the hash only depends on the last 64 bytes */
+	for (i = DEDUP_MIN - 64; i < length; i++) {
+		hash = (hash << 1) + dedup->gear[data[i]];
+		if (i >= DEDUP_MIN && !(hash & DEDUP_MASK))
+			return i + 1;
+	}
+
+	return length;
+}
+
+static struct dedup_entry* dedup_slot_of(struct dedup_entry* table, unsigned long capacity, const unsigned long* fingerprint, unsigned long length)
+{
+	unsigned long i;
+
+	for (i = fingerprint[0] & (capacity - 1); table[i].length; i = (i + 1) & (capacity - 1)) {
+		if (table[i].length == length && table[i].fingerprint[0] == fingerprint[0] && table[i].fingerprint[1] == fingerprint[1])
+			break;
+	}
+
+	return &table[i];
 }
 
-int pack_file_compressed(const char* input_file, FILE* output_file)
+/*
+ * Look a block up by its fingerprint: returns 1 and its first occurrence if
+ * it was seen before, or 0 after recording it at the current position. -1 if
+ * the table cannot grow.
+ */
+static int dedup_lookup(struct dedup_state* dedup, const unsigned char* data, size_t length, unsigned long* file, unsigned long* offset)
+{
+	struct dedup_entry* table;
+	struct dedup_entry* entry;
+	unsigned long fingerprint[2];
+	unsigned long i;
+
+	if (length <= DEDUP_SHORTEST)
+		return 0;
+
+	/* keep the table at most half full */
+	if (dedup->count * 2 >= dedup->capacity) {
+		table = (struct dedup_entry*)calloc(dedup->capacity * 2, sizeof(struct dedup_entry));
+		if (!table)
+			return -1;
+		for (i = 0; i < dedup->capacity; i++) {
+			if (dedup->table[i].length)
+				*dedup_slot_of(table, dedup->capacity * 2, dedup->table[i].fingerprint, dedup->table[i].length) = dedup->table[i];
+		}
+		free(dedup->table);
+		dedup->table = table;
+		dedup->capacity *= 2;
+	}
+
+	block_fingerprint(data, length, fingerprint);
+	entry = dedup_slot_of(dedup->table, dedup->capacity, fingerprint, length);
+	if (entry->length) {
+		*file = entry->file;
+		*offset = entry->offset;
+		return 1;
+	}
+
+	entry->fingerprint[0] = fingerprint[0];
+	entry->fingerprint[1] = fingerprint[1];
+	entry->length = length;
+	entry->file = dedup->file;
+	entry->offset = dedup->offset;
+	dedup->count++;
+
+	return 0;
+}
+
+/*
+ * Pipelined compression in three stages: a reader thread reads BLOCK_SIZE
+ * blocks into a fixed ring of slots (or points them into the mapped input),
+ * workers compress them concurrently, and the calling thread writes the
+ * finished chunks back in input order. Reading, compressing and writing thus
+ * overlap, the archive is byte-identical to the single-threaded one, and
+ * memory stays bounded by the number of slots.
+ *
+ * For a multi-file archive the reader walks the files instead: a slot then
+ * also carries the file headers the writer puts before its chunk, and may be
+ * a solid block of small files or hold no data at all for an empty file.
+ *
+ * With --dedup the reader also cuts the blocks and looks them up, so a slot
+ * may hold a reference that the workers pass over. What the reader read past
+ * the cut goes to the front of the next slot.
+ */
+#define SLOT_EMPTY 0
+#define SLOT_QUEUED 1
+#define SLOT_DONE 2
+
+struct pack_slot {
+	unsigned char* buffer;
+	const unsigned char* input;
+	unsigned char* result;
+	unsigned char* scratch;
+	const unsigned char* data;
+	size_t bytes_read;
+	int chunk_id;
+	unsigned long first_entry;
+	unsigned long entry_count;
+	unsigned long source_file;
+	unsigned long source_offset;
+	int chunk_size;
+	int codec;
+	unsigned long checksum;
+	int state;
+};
+
+struct pack_pool {
+	struct pack_slot* slots;
+	unsigned long slot_count;
+	unsigned long next_read;
+	unsigned long next_job;
+	unsigned long next_write;
+	const struct pack_options* options;
+	struct pack_input* in;
+	struct pack_tree* tree;
+	struct dedup_state* dedup;
+	unsigned long total_read;
+	int eof;
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_cond_t job_done;
+	pthread_cond_t slot_free;
+};
+
+/*
+ * Fill a slot from the files of a multi-file archive: the next block of a
+ * large file, with the file header before its first block, or as many small
+ * files as fit into a solid block. Returns 0 after the last file and -1 if
+ * a file cannot be read.
+ */
+static int read_tree_slot(struct pack_tree* tree, unsigned char* buffer, struct pack_slot* slot)
+{
+	struct pack_entry* entry;
+	FILE* in;
+	size_t size;
+
+	slot->first_entry = tree->next;
+	if (!tree->file && slot->bytes_read == 0) {
+		if (tree->next == tree->count)
+			return 0;
+		entry = &tree->entries[tree->next];
+
+		/* an empty file is just its header */
+		if (entry->size == 0) {
+			slot->entry_count = 1;
+			tree->next++;
+			return 1;
+		}
+
+		if (entry->size < SOLID_LIMIT) {
+			slot->chunk_id = SOLID_CHUNK_ID;
+			while (tree->next < tree->count) {
+				entry = &tree->entries[tree->next];
+				if (entry->size == 0 || entry->size >= SOLID_LIMIT || slot->bytes_read + entry->size > BLOCK_SIZE)
+					break;
+				in = fopen(entry->path, "rb");
+				size = in ? fread(buffer + slot->bytes_read, 1, entry->size, in) : 0;
+				if (in)
+					fclose(in);
+				if (size != entry->size) {
+					printf("Error: reading %s failed!\n", entry->path);
+					return -1;
+				}
+				slot->bytes_read += size;
+				slot->entry_count++;
+				tree->next++;
+			}
+			return 1;
+		}
+
+		tree->file = fopen(entry->path, "rb");
+		if (!tree->file) {
+			printf("Error: could not open %s\n", entry->path);
+			return -1;
+		}
+		tree->remaining = entry->size;
+		slot->entry_count = 1;
+		tree->next++;
+	}
+
+	/* the size from the header is what goes into the archive; a dedup block may be there already */
+	size = BLOCK_SIZE - slot->bytes_read;
+	if (tree->remaining < size)
+		size = tree->remaining;
+	if (size > 0 && fread(buffer + slot->bytes_read, 1, size, tree->file) != size) {
+		printf("Error: reading %s failed!\n", tree->entries[tree->next - 1].path);
+		return -1;
+	}
+	slot->bytes_read += size;
+	tree->remaining -= size;
+	if (tree->remaining == 0 && tree->file) {
+		fclose(tree->file);
+		tree->file = NULL;
+	}
+
+	return 1;
+}
+
+/* cut a block off the slot and turn it into a reference if it was seen before */
+static int dedup_block(struct pack_pool* pool, struct pack_slot* slot)
+{
+	struct dedup_state* dedup = pool->dedup;
+	size_t length = dedup_cut(dedup, slot->input, slot->bytes_read);
+	size_t rest = slot->bytes_read - length;
+	int found;
+
+	/* the first block of a file in a tree */
+	if (slot->entry_count > 0) {
+		dedup->file = slot->first_entry;
+		dedup->offset = 0;
+	}
+
+	/* the rest is read again from the mapping, or kept for the next slot */
+	if (rest > 0 && slot->input != slot->buffer) {
+		pool->in->pos -= rest;
+	} else if (rest > 0) {
+		memcpy(dedup->carry, slot->input + length, rest);
+		dedup->carry_length = rest;
+	}
+	slot->bytes_read = length;
+
+	found = dedup_lookup(dedup, slot->input, length, &slot->source_file, &slot->source_offset);
+	if (found < 0) {
+		printf("Error: not enough memory for the dedup table!\n");
+		return -1;
+	}
+	if (found)
+		slot->chunk_id = REFERENCE_CHUNK_ID;
+	dedup->offset += length;
+
+	return 1;
+}
+
+static void* pack_reader(void* arg)
+{
+	struct pack_pool* pool = (struct pack_pool*)arg;
+	struct pack_slot* slot;
+	int status;
+
+	while (1) {
+		/* wait until the writer has emptied the next slot */
+		pthread_mutex_lock(&pool->lock);
+		while (pool->next_read - pool->next_write >= pool->slot_count)
+			pthread_cond_wait(&pool->slot_free, &pool->lock);
+		slot = &pool->slots[pool->next_read % pool->slot_count];
+		pthread_mutex_unlock(&pool->lock);
+
+		slot->input = slot->buffer;
+		slot->bytes_read = 0;
+		slot->chunk_id = 17;
+		slot->entry_count = 0;
+		if (pool->dedup && pool->dedup->carry_length > 0) {
+			memcpy(slot->buffer, pool->dedup->carry, pool->dedup->carry_length);
+			slot->bytes_read = pool->dedup->carry_length;
+			pool->dedup->carry_length = 0;
+		}
+		if (pool->tree) {
+			status = read_tree_slot(pool->tree, slot->buffer, slot);
+		} else {
+			slot->bytes_read = read_block(pool->in, slot->buffer, slot->bytes_read, &slot->input);
+			status = slot->bytes_read > 0;
+		}
+		if (status > 0 && pool->dedup && slot->chunk_id == 17 && slot->bytes_read > 0)
+			status = dedup_block(pool, slot);
+
+		pthread_mutex_lock(&pool->lock);
+		if (status <= 0) {
+			pool->eof = 1;
+			pool->failed = status < 0;
+		} else {
+			slot->state = SLOT_QUEUED;
+			pool->total_read += slot->bytes_read;
+			pool->next_read++;
+		}
+		pthread_cond_broadcast(&pool->job_ready);
+		pthread_cond_broadcast(&pool->job_done);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (status <= 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static void* pack_worker(void* arg)
+{
+	struct pack_pool* pool = (struct pack_pool*)arg;
+	struct pack_slot* slot;
+	lz77_cctx ctx;
+
+	lz77_cctx_init(&ctx);
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->next_job == pool->next_read && !pool->eof)
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+		if (pool->next_job == pool->next_read) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		slot = &pool->slots[pool->next_job % pool->slot_count];
+		pool->next_job++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (slot->bytes_read > 0 && slot->chunk_id != REFERENCE_CHUNK_ID) {
+			slot->codec = compress_block(&ctx, pool->options->level, pool->options->format, pool->options->huff,
+				slot->input, slot->bytes_read, slot->result, slot->scratch, &slot->chunk_size);
+			slot->codec |= pool->options->checks;
+			slot->data = (slot->codec & 255) == CHUNK_STORED ? slot->input : slot->result;
+			slot->checksum = block_checksum(slot->codec, slot->input, slot->bytes_read, slot->data, slot->chunk_size);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&pool->job_done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+/* compress the blocks of `in`, or the files of `tree` when `in` is NULL */
+unsigned long pack_blocks_parallel(const struct pack_options* options, struct pack_input* in, struct pack_tree* tree, FILE* output_file, struct chunk_index* index)
+{
+	struct pack_pool pool;
+	struct pack_slot* slot;
+	struct pack_entry* entry;
+	struct dedup_state dedup;
+	pthread_t workers[MAX_THREADS];
+	pthread_t reader;
+	unsigned long total_read;
+	unsigned long i;
+	int mapped = in && in->map;
+	int huff = options->format == CHUNK_LZ77_HUFF;
+	int threads = options->threads;
+	int started = 0;
+	int failed = 0;
+
+	/* besides the blocks being compressed, one is being read and one written */
+	pool.slot_count = (unsigned long)threads * BLOCKS_PER_THREAD + 2;
+	pool.slots = (struct pack_slot*)calloc(pool.slot_count, sizeof(struct pack_slot));
+	pool.next_read = pool.next_job = pool.next_write = 0;
+	pool.options = options;
+	pool.in = in;
+	pool.tree = tree;
+	pool.dedup = NULL;
+	pool.total_read = 0;
+	pool.eof = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.job_ready, NULL);
+	pthread_cond_init(&pool.job_done, NULL);
+	pthread_cond_init(&pool.slot_free, NULL);
+
+	for (i = 0; pool.slots && i < pool.slot_count; i++) {
+		pool.slots[i].buffer = mapped ? NULL : (unsigned char*)malloc(BLOCK_SIZE);
+		pool.slots[i].result = (unsigned char*)malloc(BLOCK_SIZE * 2);
+		pool.slots[i].scratch = huff ? (unsigned char*)malloc(BLOCK_SIZE * 2) : NULL;
+		if ((!mapped && !pool.slots[i].buffer) || !pool.slots[i].result || (huff && !pool.slots[i].scratch))
+			failed = 1;
+	}
+
+	if (!pool.slots || failed) {
+		printf("Error: not enough memory for %d threads!\n", threads);
+		failed = 1;
+	}
+
+	memset(&dedup, 0, sizeof(dedup));
+	if (!failed && options->dedup) {
+		if (dedup_init(&dedup)) {
+			printf("Error: not enough memory for the dedup table!\n");
+			failed = 1;
+		}
+		pool.dedup = &dedup;
+	}
+
+	while (!failed && started < threads) {
+		if (pthread_create(&workers[started], NULL, pack_worker, &pool) != 0)
+			break;
+		started++;
+	}
+
+	if (!failed && started == 0) {
+		printf("Error: could not start worker threads!\n");
+		failed = 1;
+	}
+
+	if (!failed && pthread_create(&reader, NULL, pack_reader, &pool) != 0) {
+		printf("Error: could not start the reader thread!\n");
+		failed = 1;
+
+		/* let the workers run out of jobs */
+		pthread_mutex_lock(&pool.lock);
+		pool.eof = 1;
+		pthread_cond_broadcast(&pool.job_ready);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	while (!failed) {
+		/* the oldest block must go out first */
+		pthread_mutex_lock(&pool.lock);
+		while (pool.next_write == pool.next_read && !pool.eof)
+			pthread_cond_wait(&pool.job_done, &pool.lock);
+		if (pool.next_write == pool.next_read) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		slot = &pool.slots[pool.next_write % pool.slot_count];
+		while (slot->state != SLOT_DONE)
+			pthread_cond_wait(&pool.job_done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		for (i = slot->first_entry; i < slot->first_entry + slot->entry_count; i++) {
+			entry = &tree->entries[i];
+			write_file_header(output_file, entry->name, entry->size,
+				(slot->chunk_id == SOLID_CHUNK_ID ? FILE_SOLID : 0) | (options->dedup ? FILE_DEDUP : 0));
+		}
+		if (slot->chunk_id == SOLID_CHUNK_ID) {
+			write_chunk_header(output_file, SOLID_CHUNK_ID, slot->codec, slot->chunk_size, slot->checksum, slot->bytes_read);
+			fwrite(slot->data, 1, slot->chunk_size, output_file);
+		} else if (slot->chunk_id == REFERENCE_CHUNK_ID) {
+			write_reference_chunk(output_file, slot->source_file, slot->source_offset, slot->bytes_read);
+		} else if (slot->bytes_read > 0) {
+			write_data_chunk(output_file, index, slot->codec, slot->data, slot->chunk_size, slot->checksum, slot->bytes_read);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		slot->state = SLOT_EMPTY;
+		pool.next_write++;
+		pthread_cond_signal(&pool.slot_free);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	if (!failed)
+		pthread_join(reader, NULL);
+	while (started > 0)
+		pthread_join(workers[--started], NULL);
+
+	total_read = failed || pool.failed ? (unsigned long)-1 : pool.total_read;
+
+	for (i = 0; pool.slots && i < pool.slot_count; i++) {
+		free(pool.slots[i].buffer);
+		free(pool.slots[i].result);
+		free(pool.slots[i].scratch);
+	}
+	free(pool.slots);
+	dedup_free(&dedup);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.job_ready);
+	pthread_cond_destroy(&pool.job_done);
+	pthread_cond_destroy(&pool.slot_free);
+
+	return total_read;
+}
+
+int pack_file_compressed(const struct pack_options* options, const char* input_file, FILE* output_file)
 {
 	FILE *in;
 	unsigned long fsize;
 	const char* shown_name;
 	unsigned char buffer[BLOCK_SIZE];
 	unsigned char result[BLOCK_SIZE * 2];
+	unsigned char scratch[BLOCK_SIZE * 2];
+	const unsigned char* block;
+	const unsigned char* data;
+	struct pack_input input;
 	unsigned long checksum;
 	unsigned long total_read;
 	size_t bytes_read;
 	int chunk_size;
+	int codec;
+	struct chunk_index chunk_index;
+	struct chunk_index* index = NULL;
+	lz77_stream stream;
+	lz77_cctx ctx;
+	int result_code = 0;
 
-	in = fopen(input_file, "rb");
-	if (!in) {
-		printf("Error: could not open %s\n", input_file);
-		return -1;
+	/* stdin is read in blocks as it comes, its length is only known at the end */
+	if (!strcmp(input_file, "-")) {
+		in = stdin;
+		fsize = STREAM_SIZE;
+		shown_name = STREAM_NAME;
+	} else {
+		in = fopen(input_file, "rb");
+		if (!in) {
+			printf("Error: could not open %s\n", input_file);
+			return -1;
+		}
+
+		fseek(in, 0, SEEK_END);
+		fsize = ftell(in);
+		fseek(in, 0, SEEK_SET);
+
+		if (detect_magic(in)) {
+			printf("Error: file %s is already a phyzip archive!\n", input_file);
+			fclose(in);
+			return -1;
+		}
+
+		/* truncate directory prefix, e.g. "/path/to/FILE.txt" becomes "FILE.txt" */
+		shown_name = input_file + strlen(input_file) - 1;
+		while (shown_name > input_file)
+			if (*(shown_name - 1) == '/')
+				break;
+			else
+				shown_name--;
+	}
+
+	write_file_header(output_file, shown_name, fsize, options->dedup ? FILE_DEDUP : 0);
+
+	if (options->index) {
+		memset(&chunk_index, 0, sizeof(chunk_index));
+		index = &chunk_index;
 	}
 
-	fseek(in, 0, SEEK_END);
-	fsize = ftell(in);
-	fseek(in, 0, SEEK_SET);
+	/* blocks come straight from the mapped file; if it cannot be mapped, they are read */
+	input.file = in;
+	input.map = NULL;
+	input.size = fsize;
+	input.pos = 0;
+	if (options->mmap && fsize > 0 && fsize != STREAM_SIZE) {
+		void* map = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fileno(in), 0);
 
-	if (detect_magic(in)) {
-		printf("Error: file %s is already a phyzip archive!\n", input_file);
+		if (map != MAP_FAILED) {
+			posix_madvise(map, fsize, POSIX_MADV_SEQUENTIAL);
+			input.map = (const unsigned char*)map;
+		}
+	}
+
+	/* the reader thread of the pipeline cuts and looks up the dedup blocks */
+	if (options->threads > 1 || options->pipeline || options->dedup) {
+		total_read = pack_blocks_parallel(options, &input, NULL, output_file, index);
+	} else {
+		/* linked chunks may refer to the window of the previous chunk */
+		lz77_stream_init(&stream);
+		lz77_cctx_init(&ctx);
+		total_read = 0;
+		while (1) {
+			bytes_read = read_block(&input, buffer, 0, &block);
+			total_read += bytes_read;
+
+			if (bytes_read == 0)
+				break;
+
+			/* the window of linked chunks needs every block compressed */
+			if (options->linked) {
+				chunk_size = lz77_compress_continue(&stream, block, bytes_read, result);
+				codec = options->format | CHUNK_LINKED;
+			} else {
+				codec = compress_block(&ctx, options->level, options->format, options->huff, block, bytes_read, result, scratch, &chunk_size);
+			}
+			if (chunk_size == 0) {
+				printf("Error: not enough memory!\n");
+				total_read = (unsigned long)-1;
+				break;
+			}
+			codec |= options->checks;
+			data = (codec & 255) == CHUNK_STORED ? block : result;
+			checksum = block_checksum(codec, block, bytes_read, data, chunk_size);
+			write_data_chunk(output_file, index, codec, data, chunk_size, checksum, bytes_read);
+		}
+		lz77_stream_free(&stream);
+	}
+
+	if (input.map)
+		munmap((void*)input.map, fsize);
+	if (ferror(in))
+		total_read = (unsigned long)-1;
+	if (in != stdin)
 		fclose(in);
+
+	if (total_read == (unsigned long)-1 || (fsize != STREAM_SIZE && total_read != fsize)) {
+		printf("Error: reading %s failed!\n", input_file);
+		result_code = -1;
+	} else if (index) {
+		result_code = write_index(output_file, index);
+	}
+
+	if (index) {
+		free(index->offsets);
+		free(index->positions);
+	}
+
+	return result_code;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int add_path(struct pack_tree* tree, char* path, size_t name_offset, int follow);
+
+/* add the entries of a directory in name order, so archives are reproducible */
+static int add_directory(struct pack_tree* tree, const char* path, size_t name_offset)
+{
+	DIR* dir;
+	struct dirent* entry;
+	char** names = NULL;
+	char** grown;
+	char* child;
+	unsigned long count = 0;
+	unsigned long capacity = 0;
+	unsigned long i;
+	size_t length = strlen(path);
+	int result = 0;
+
+	dir = opendir(path);
+	if (!dir) {
+		printf("Error: could not open directory %s\n", path);
 		return -1;
 	}
 
-	/* truncate directory prefix, e.g. "/path/to/FILE.txt" becomes "FILE.txt" */
-	shown_name = input_file + strlen(input_file) - 1;
-	while (shown_name > input_file)
-		if (*(shown_name - 1) == '/')
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			grown = (char**)realloc(names, capacity * sizeof(char*));
+			if (!grown) {
+				result = -1;
+				break;
+			}
+			names = grown;
+		}
+		names[count] = (char*)malloc(strlen(entry->d_name) + 1);
+		if (!names[count]) {
+			result = -1;
 			break;
-		else
-			shown_name--;
-
-	buffer[0] = fsize & 255;
-	buffer[1] = (fsize >> 8) & 255;
-	buffer[2] = (fsize >> 16) & 255;
-	buffer[3] = (fsize >> 24) & 255;
-	buffer[4] = (fsize >> 32) & 255;
-	buffer[5] = (fsize >> 40) & 255;
-	buffer[6] = (fsize >> 48) & 255;
-	buffer[7] = (fsize >> 56) & 255;
-	buffer[8] = (strlen(shown_name) + 1) & 255;
-	buffer[9] = (strlen(shown_name) + 1) >> 8;
-
-    /*
-	 * 00000000  24 70 68 79 7a 69 70 24  01 00 00 00 0f 00 00 00  |$phyzip$........|
-	 * 00000010  a5 01 21 06 00 00 00 00  09 00 00 00 00 00 00 00  |..!.............|
-	 * 00000020  05 00 4e 6f 74 65 00                              |..Note.|
-	 */
-	checksum = 1L;
-	checksum = update_adler32(checksum, buffer, 10);
-	checksum = update_adler32(checksum, shown_name, strlen(shown_name) + 1);
-	write_chunk_header(output_file, 1, 0, 10 + strlen(shown_name) + 1, checksum, 0);
-	fwrite(buffer, 10, 1, output_file);
-	fwrite(shown_name, strlen(shown_name) + 1, 1, output_file);
+		}
+		strcpy(names[count++], entry->d_name);
+	}
+	closedir(dir);
 
-	while (1) {
-		bytes_read = fread(buffer, 1, BLOCK_SIZE, in);
-		total_read += bytes_read;
+	if (result)
+		printf("Error: not enough memory!\n");
+	else if (count > 0)
+		qsort(names, count, sizeof(char*), compare_names);
 
-		if (bytes_read == 0)
-			break;
+	for (i = 0; i < count; i++) {
+		child = result ? NULL : (char*)malloc(length + strlen(names[i]) + 2);
+		if (child) {
+			strcpy(child, path);
+			if (length > 0 && path[length - 1] != '/')
+				strcat(child, "/");
+			strcat(child, names[i]);
+			result = add_path(tree, child, name_offset, 0);
+		} else if (!result) {
+			printf("Error: not enough memory!\n");
+			result = -1;
+		}
+		free(names[i]);
+	}
+	free(names);
 
-		chunk_size = lz77_compress(buffer, bytes_read, result);
-		checksum = update_adler32(1L, result, chunk_size);
-		write_chunk_header(output_file, 17, 1, chunk_size, checksum, bytes_read);
-		fwrite(result, 1, chunk_size, output_file);
-	} fclose(in);
+	return result;
+}
 
-	if (total_read != fsize) {
-		printf("Error: reading %s failed!\n", input_file);
+/*
+ * Add a regular file, or every regular file below a directory, to the tree;
+ * `path` is taken over. Symbolic links are only followed when named on the
+ * command line, and the archive being written is left out.
+ */
+static int add_path(struct pack_tree* tree, char* path, size_t name_offset, int follow)
+{
+	struct pack_entry* entries;
+	struct stat st;
+	int result;
+
+	if ((follow ? stat(path, &st) : lstat(path, &st)) != 0) {
+		printf("Error: could not open %s\n", path);
+		free(path);
 		return -1;
 	}
 
+	if (S_ISDIR(st.st_mode)) {
+		result = add_directory(tree, path, name_offset);
+		free(path);
+		return result;
+	}
+
+	if (!S_ISREG(st.st_mode) || (st.st_dev == tree->skip_dev && st.st_ino == tree->skip_ino)) {
+		free(path);
+		return 0;
+	}
+
+	if (tree->count == tree->capacity) {
+		tree->capacity = tree->capacity ? tree->capacity * 2 : 256;
+		entries = (struct pack_entry*)realloc(tree->entries, tree->capacity * sizeof(struct pack_entry));
+		if (!entries) {
+			printf("Error: not enough memory!\n");
+			free(path);
+			return -1;
+		}
+		tree->entries = entries;
+	}
+
+	tree->entries[tree->count].path = path;
+	tree->entries[tree->count].name = path + name_offset;
+	tree->entries[tree->count].size = (unsigned long)st.st_size;
+	tree->count++;
+
 	return 0;
 }
 
-int pack_file(const char *input_file, const char *output_file)
+/*
+ * Multi-file archive: every input is added with its last path component, so
+ * "/path/to/src" is archived as "src/...", and each file gets its own header.
+ * Files of at least SOLID_LIMIT bytes are compressed block by block as
+ * before; smaller ones are gathered into solid blocks (id 18) of up to
+ * BLOCK_SIZE, where they share one window. Their headers carry FILE_SOLID and
+ * come right before the block that holds their data, in the same order.
+ */
+int pack_tree_compressed(const struct pack_options* options, char** input_files, int input_count, FILE* output_file)
+{
+	struct pack_tree tree;
+	struct stat st;
+	unsigned long total_size = 0;
+	unsigned long total_read;
+	unsigned long i;
+	size_t length;
+	char* path;
+	const char* base;
+	int result = 0;
+	int c;
+
+	memset(&tree, 0, sizeof(tree));
+	if (fstat(fileno(output_file), &st) == 0) {
+		tree.skip_dev = st.st_dev;
+		tree.skip_ino = st.st_ino;
+	}
+
+	for (c = 0; result == 0 && c < input_count; c++) {
+		if (!strcmp(input_files[c], "-")) {
+			printf("Error: stdin cannot be archived together with other files\n");
+			result = -1;
+			break;
+		}
+
+		/* "dir/" is "dir", and the contents of "." or ".." go in without a prefix */
+		path = (char*)malloc(strlen(input_files[c]) + 1);
+		if (!path) {
+			printf("Error: not enough memory!\n");
+			result = -1;
+			break;
+		}
+		strcpy(path, input_files[c]);
+		length = strlen(path);
+		while (length > 1 && path[length - 1] == '/')
+			path[--length] = 0;
+		base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+		if (!strcmp(base, ".") || !strcmp(base, "..") || !*base)
+			base = path + length + (path[length - 1] != '/');
+
+		result = add_path(&tree, path, base - path, 1);
+	}
+
+	for (i = 0; i < tree.count; i++)
+		total_size += tree.entries[i].size;
+
+	if (result == 0) {
+		/* each slot is a job for whichever worker is free first */
+		total_read = pack_blocks_parallel(options, NULL, &tree, output_file, NULL);
+		if (total_read != total_size)
+			result = -1;
+	}
+
+	if (tree.file)
+		fclose(tree.file);
+	for (i = 0; i < tree.count; i++)
+		free(tree.entries[i].path);
+	free(tree.entries);
+
+	return result;
+}
+
+int pack_file(const struct pack_options* options, char** input_files, int input_count, int tree, const char *output_file)
 {
 	FILE *file;
 	int result;
 
-	file = fopen(output_file, "rb");
-	if (file) {
-		printf("Error: file %s already exists. Aborted.\n\n", output_file);
-		fclose(file);
-		return -1;
-	}
+	if (!strcmp(output_file, "-")) {
+		file = open_stdout_stream();
+		if (!file) {
+			printf("Error: could not write to stdout. Aborted.\n\n");
+			return -1;
+		}
+	} else {
+		file = fopen(output_file, "rb");
+		if (file) {
+			printf("Error: file %s already exists. Aborted.\n\n", output_file);
+			fclose(file);
+			return -1;
+		}
 
-	file = fopen(output_file, "wb");
-	if (!file) {
-		printf("Error: could not create %s. Aborted.\n\n", output_file);
-		return -1;
+		file = fopen(output_file, "wb");
+		if (!file) {
+			printf("Error: could not create %s. Aborted.\n\n", output_file);
+			return -1;
+		}
 	}
 
 	write_magic(file);
-	result = pack_file_compressed(input_file, file);
-	fclose(file);
+	if (tree)
+		result = pack_tree_compressed(options, input_files, input_count, file);
+	else
+		result = pack_file_compressed(options, input_files[0], file);
+	if (fclose(file) != 0 && result == 0) {
+		printf("Error: writing %s failed!\n", output_file);
+		result = -1;
+	}
 
 	return result;
 }
@@ -214,8 +1252,32 @@ void usage(void)
 	printf("phyzip: high-speed file compression tool\n");
 	printf("\n");
 	printf("Usage: phyzip [options] input-file output-file\n");
+	printf("       phyzip [options] file-or-directory... output-file\n");
+	printf("\n");
+	printf("A file name of - reads stdin or writes stdout. Directories are archived\n");
+	printf("recursively, and small files are packed together into solid blocks.\n");
 	printf("\n");
 	printf("Options:\n");
+	printf("  -1    fastest compression (default)\n");
+	printf("  -9    best compression, -2..-8 trade speed for ratio\n");
+	printf("  --ultra\n");
+	printf("        optimal parsing, for archives that are written once\n");
+	printf("  --v2  use format v2: 64 KB window, less overhead on raw data\n");
+	printf("  --huff\n");
+	printf("        Huffman-code the literals of each block, for archives kept long\n");
+	printf("  --huff-tokens\n");
+	printf("        Huffman-code the literals and the match tokens\n");
+	printf("  -T N  compress with N worker threads (default 1)\n");
+	printf("  -p    overlap reading, compression and writing (implied by -T)\n");
+	printf("  -i    append a chunk index for random access (--range)\n");
+	printf("  -l    link blocks: let each block refer to the previous one\n");
+	printf("  -m    read the input through a memory mapping\n");
+	printf("  --dedup\n");
+	printf("        cut blocks by content and store repeated blocks as references\n");
+	printf("  --xxh64\n");
+	printf("        checksum chunks with XXH64 instead of Adler-32\n");
+	printf("  --checksum-data\n");
+	printf("        checksum the uncompressed data, which also covers decoding\n");
 	printf("  -v    show program version\n");
 	printf("\n");
 }
@@ -223,14 +1285,38 @@ void usage(void)
 int main(int argc, char **argv)
 {
 	int i;
-	char *input_file = NULL;
+	char **input_files;
+	int input_count = 0;
 	char *output_file = NULL;
+	struct stat st;
+	int tree;
+	int v2 = 0;
+	int huff = 0;
+	struct pack_options options;
+
+	options.level = LZ77_LEVEL_MIN;
+	options.format = CHUNK_LZ77;
+	options.huff = 0;
+	options.threads = 1;
+	options.index = 0;
+	options.linked = 0;
+	options.mmap = 0;
+	options.pipeline = 0;
+	options.checks = 0;
+	options.dedup = 0;
 
 	if (argc == 1) {
 		usage();
 		return 0;
 	}
 
+	/* the last of the file arguments is the output */
+	input_files = (char**)malloc(argc * sizeof(char*));
+	if (!input_files) {
+		printf("Error: not enough memory!\n");
+		return -1;
+	}
+
 	for (i = 1; i <= argc; i++) {
 		char* argument = argv[i];
 
@@ -249,26 +1335,143 @@ int main(int argc, char **argv)
 			return 0;
 		}
 
-		/* unknown option */
-		if (argument[0] == '-') {
-			printf("Error: unknown option %s\n\n", argument);
-			printf("To get help on usage:\n");
-			printf("  phyzip --help\n\n");
-			return -1;
+		if (argument[0] == '-' && argument[1] >= '1' && argument[1] <= '9' && !argument[2]) {
+			options.level = argument[1] - '0';
+			continue;
+		}
+
+		if (!strcmp(argument, "--ultra")) {
+			options.level = LZ77_LEVEL_ULTRA;
+			continue;
+		}
+
+		if (!strcmp(argument, "--v2")) {
+			v2 = 1;
+			continue;
+		}
+
+		/* the Huffman stage works on v1 blocks */
+		if (!strcmp(argument, "--huff") || !strcmp(argument, "--huff-tokens")) {
+			huff = 1;
+			if (!strcmp(argument, "--huff-tokens"))
+				options.huff = LZ77_HUFF_TOKENS;
+			continue;
+		}
+
+		if (!strcmp(argument, "-i") || !strcmp(argument, "--index")) {
+			options.index = 1;
+			continue;
+		}
+
+		if (!strcmp(argument, "-l") || !strcmp(argument, "--linked")) {
+			options.linked = 1;
+			continue;
 		}
 
-		/* first specified file is input */
-		if (!input_file) {
-			input_file = argument;
+		if (!strcmp(argument, "-p") || !strcmp(argument, "--pipeline")) {
+			options.pipeline = 1;
 			continue;
 		}
 
-		/* next specified file is output */
-		if (!output_file) {
-			output_file = argument;
+		if (!strcmp(argument, "-m") || !strcmp(argument, "--mmap")) {
+			options.mmap = 1;
 			continue;
 		}
+
+		if (!strcmp(argument, "--dedup")) {
+			options.dedup = 1;
+			continue;
+		}
+
+		if (!strcmp(argument, "--xxh64")) {
+			options.checks |= CHUNK_XXH64;
+			continue;
+		}
+
+		if (!strcmp(argument, "--checksum-data")) {
+			options.checks |= CHUNK_RAW_CHECKSUM;
+			continue;
+		}
+
+		if (!strncmp(argument, "-T", 2)) {
+			const char* value = argument[2] ? argument + 2 : argv[++i];
+
+			options.threads = value ? atoi(value) : 0;
+			if (options.threads < 1 || options.threads > MAX_THREADS) {
+				printf("Error: thread count must be between 1 and %d\n\n", MAX_THREADS);
+				return -1;
+			}
+			continue;
+		}
+
+		/* unknown option; a single - is stdin or stdout */
+		if (argument[0] == '-' && argument[1]) {
+			printf("Error: unknown option %s\n\n", argument);
+			printf("To get help on usage:\n");
+			printf("  phyzip --help\n\n");
+			return -1;
+		}
+
+		input_files[input_count++] = argument;
+	}
+
+	if (input_count < 2) {
+		usage();
+		return -1;
+	}
+	output_file = input_files[--input_count];
+
+	/* several inputs or a directory make a multi-file archive */
+	tree = input_count > 1 || (stat(input_files[0], &st) == 0 && S_ISDIR(st.st_mode));
+	if (v2 && huff) {
+		printf("Error: --huff cannot be combined with --v2\n\n");
+		return -1;
+	}
+	if (v2)
+		options.format = CHUNK_LZ77_V2;
+	else if (huff)
+		options.format = CHUNK_LZ77_HUFF;
+
+	if (tree && (options.index || options.linked || options.mmap)) {
+		printf("Error: -i, -l and -m apply to a single input file\n\n");
+		return -1;
+	}
+
+	/* linked blocks depend on each other and must be compressed in order */
+	if (options.linked && (options.threads > 1 || options.pipeline)) {
+		printf("Error: -l cannot be combined with -T or -p\n\n");
+		return -1;
+	}
+
+	/* the stream compressor only implements the fastest level of v1 */
+	if (options.linked && (options.level > LZ77_LEVEL_MIN || options.format != CHUNK_LZ77)) {
+		printf("Error: -l cannot be combined with -2..-9, --ultra, --v2 or --huff\n\n");
+		return -1;
+	}
+
+	/* references stand for blocks that are neither indexed nor linked */
+	if (options.dedup && (options.index || options.linked)) {
+		printf("Error: --dedup cannot be combined with -i or -l\n\n");
+		return -1;
+	}
+
+	/* the index records archive positions, which a pipe does not have */
+	if (options.index && !strcmp(output_file, "-")) {
+		printf("Error: -i cannot be used when writing to stdout\n\n");
+		return -1;
+	}
+
+	/* references are resolved by seeking back in the archive */
+	if (options.dedup && !strcmp(output_file, "-")) {
+		printf("Error: --dedup cannot be used when writing to stdout\n\n");
+		return -1;
+	}
+
+	/* v2 has a single level */
+	if (options.format == CHUNK_LZ77_V2 && options.level > LZ77_LEVEL_MIN) {
+		printf("Error: --v2 cannot be combined with -2..-9 or --ultra\n\n");
+		return -1;
 	}
 
-	return pack_file(input_file, output_file);
+	return pack_file(&options, input_files, input_count, tree, output_file);
 }
@@ -0,0 +1,31 @@
+/*
+ * Writing an archive or extracted data to stdout, shared by phyzip and
+ * phyunzip
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stdout_stream.h"
+#include <unistd.h>
+
+FILE* open_stdout_stream(void)
+{
+	FILE* file;
+	int fd;
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0)
+		return NULL;
+
+	file = fdopen(fd, "wb");
+	if (!file || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		if (file)
+			fclose(file);
+		else
+			close(fd);
+		return NULL;
+	}
+
+	return file;
+}
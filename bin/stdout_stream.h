@@ -0,0 +1,19 @@
+/*
+ * Writing an archive or extracted data to stdout, shared by phyzip and
+ * phyunzip
+ */
+
+#ifndef __STDOUT_STREAM_H__
+#define __STDOUT_STREAM_H__
+
+#include <stdio.h>
+
+/*
+ * Hand stdout over to the data: it is written to a duplicate of file
+ * descriptor 1, and descriptor 1 is pointed at stderr, so that messages
+ * printed along the way do not end up in the stream. Returns NULL if that
+ * fails; the caller closes the stream with fclose().
+ */
+FILE* open_stdout_stream(void);
+
+#endif
@@ -5,7 +5,162 @@
  #ifndef __LZ77_H__
  #define __LZ77_H__
 
+#define LZ77_WINDOW_SIZE	8192
+#define LZ77_HASH_LOG		13
+
 int lz77_compress(const void* input, int length, void* output);
 int lz77_decompress(const void* input, int length, void* output, int maxout);
 
+/*
+ * Name of the kernel variant in use ("bytes", "word", "sse2" or "avx2"). The
+ * widest variant the CPU supports is picked at load time; the environment
+ * variable LZ77_KERNEL forces another one, e.g. LZ77_KERNEL=sse2.
+ */
+const char* lz77_kernel_name(void);
+
+/*
+ * Reusable compression context. lz77_compress sets up and clears a hash
+ * table on every call; a context is initialized once (e.g. per thread) and
+ * then reset in constant time by each lz77_compress_cctx call. The output is
+ * identical to lz77_compress.
+ */
+typedef struct lz77_cctx {
+	unsigned int htab[1 << LZ77_HASH_LOG];
+	unsigned int offset;
+} lz77_cctx;
+
+void lz77_cctx_init(lz77_cctx* ctx);
+int lz77_compress_cctx(lz77_cctx* ctx, const void* input, int length, void* output);
+
+/*
+ * Incompressible data: lz77_compress_limit() works like lz77_compress_cctx()
+ * but checks its progress every 4 KB of input and gives up, returning 0, as
+ * soon as the output is on course to exceed `maxout` bytes, so such data
+ * costs only a fraction of a full compression. It also returns 0 when the
+ * final output is larger than `maxout`. `output` must still be as large as
+ * for lz77_compress. A `maxout` of 0 means no limit.
+ */
+int lz77_compress_limit(lz77_cctx* ctx, const void* input, int length, void* output, int maxout);
+
+/*
+ * Level 1 is lz77_compress. Levels 2..9 search hash chains of increasing
+ * depth, with lazy matching from level 4 on. LZ77_LEVEL_ULTRA finds the
+ * longest matches with a binary tree and picks the cheapest token sequence
+ * by optimal parsing; it is many times slower and allocates about 1 MB,
+ * returning 0 if that fails. The output is always decoded by
+ * lz77_decompress. Levels out of range are clamped.
+ */
+#define LZ77_LEVEL_MIN		1
+#define LZ77_LEVEL_ULTRA	10
+#define LZ77_LEVEL_MAX		LZ77_LEVEL_ULTRA
+
+int lz77_compress_level(const void* input, int length, void* output, int level);
+
+/*
+ * Compression statistics: lz77_compress_ex() compresses like
+ * lz77_compress_level() and adds what it did to `stats`, which must have
+ * been set up by lz77_stats_init(), so that several blocks can be summed.
+ * The histograms count match lengths and distances in [2^i, 2^(i+1)) in
+ * bucket i. Only level 1 has a single-slot hash table, so hash_overwrites
+ * (slots holding a position of other bytes within the window) and
+ * distance_rejects (matching candidates LZ77_WINDOW_SIZE or more back) stay
+ * 0 at other levels.
+ * max_len_splits counts matches longer than one token can hold. Without
+ * `stats` the compressor runs exactly as lz77_compress_level().
+ */
+#define LZ77_STATS_BUCKETS	16
+
+typedef struct lz77_stats {
+	unsigned long literals;
+	unsigned long matches;
+	unsigned long match_bytes;
+	unsigned long length_histogram[LZ77_STATS_BUCKETS];
+	unsigned long distance_histogram[LZ77_STATS_BUCKETS];
+	unsigned long hash_overwrites;
+	unsigned long distance_rejects;
+	unsigned long max_len_splits;
+} lz77_stats;
+
+void lz77_stats_init(lz77_stats* stats);
+int lz77_compress_ex(const void* input, int length, void* output, int level, lz77_stats* stats);
+
+/*
+ * Faster compression for a lower ratio. On every miss the match search moves
+ * on by a step that grows the longer no match is found: acceleration 1 is
+ * lz77_compress, 2 starts skipping after 64 misses, and every further step
+ * starts out one byte wider, up to 32 bytes. Values above
+ * LZ77_ACCELERATION_MAX are clamped. Data the skipping search would grow is
+ * compressed again without it, so the output is no larger than that of
+ * lz77_compress_limit() or of storing the data as literals. The output is
+ * decoded by lz77_decompress.
+ */
+#define LZ77_ACCELERATION_MAX	64
+
+int lz77_compress_fast(const void* input, int length, void* output, int acceleration);
+
+/*
+ * Format v2 has a 64 KB window and variable-length literal runs and match
+ * lengths, so incompressible data grows by at most 1/255 instead of 1/32.
+ * Its first byte is a marker that lz77_decompress uses to detect the format;
+ * the streaming functions only handle v1.
+ */
+#define LZ77_FORMAT_V1	1
+#define LZ77_FORMAT_V2	2
+
+int lz77_compress_v2(const void* input, int length, void* output);
+
+/*
+ * Preset dictionary: small inputs compress much better when the window
+ * starts out with typical content. lz77_dict_init() keeps the last
+ * LZ77_WINDOW_SIZE bytes of `data` and hashes them once; it returns the
+ * number of bytes kept. The same dictionary must be used to decompress.
+ */
+typedef struct lz77_dict {
+	unsigned int htab[1 << LZ77_HASH_LOG];
+	unsigned char window[LZ77_WINDOW_SIZE + 4];
+	unsigned int size;
+} lz77_dict;
+
+int lz77_dict_init(lz77_dict* dict, const void* data, int size);
+int lz77_compress_dict(const lz77_dict* dict, const void* input, int length, void* output);
+int lz77_decompress_dict(const lz77_dict* dict, const void* input, int length, void* output, int maxout);
+
+/*
+ * Streaming compression: consecutive blocks passed to the same stream may
+ * refer to the last LZ77_WINDOW_SIZE bytes of the previous blocks. Blocks
+ * must be decompressed in the same order through their own stream.
+ * lz77_stream_free() releases the window buffer; the stream may be reused
+ * afterwards. Both functions return 0 if the window cannot be allocated.
+ */
+typedef struct lz77_stream {
+	unsigned int htab[1 << LZ77_HASH_LOG];
+	unsigned char* buffer;
+	unsigned int capacity;
+	unsigned int window_size;
+} lz77_stream;
+
+void lz77_stream_init(lz77_stream* stream);
+void lz77_stream_free(lz77_stream* stream);
+int lz77_compress_continue(lz77_stream* stream, const void* input, int length, void* output);
+int lz77_decompress_continue(lz77_stream* stream, const void* input, int length, void* output, int maxout);
+
+/*
+ * Entropy stage: lz77_huff_encode() splits a v1 block into its literal bytes
+ * and its token bytes and Huffman-codes the literals, and with
+ * LZ77_HUFF_TOKENS the tokens as well; a stream that would not shrink is
+ * kept as is. The output takes at most `length + LZ77_HUFF_OVERHEAD` bytes;
+ * it returns 0 if `input` is not a v1 block.
+ *
+ * lz77_huff_decode() needs a scratch buffer of LZ77_HUFF_SCRATCH(maxout)
+ * bytes for the decoded streams. lz77_decompress() does not accept these
+ * blocks.
+ */
+#define LZ77_FORMAT_HUFF	3
+#define LZ77_HUFF_TOKENS	1
+#define LZ77_HUFF_OVERHEAD	13
+#define LZ77_HUFF_SCRATCH(maxout)	((maxout) + (maxout) / 16 + 64)
+
+int lz77_huff_encode(const void* input, int length, void* output, int flags);
+int lz77_huff_decode(const void* input, int length, void* output, int maxout, void* scratch);
+
  #endif
@@ -4,6 +4,7 @@
 
 #include "lz77.h"
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -17,14 +18,32 @@
 #define unlikely(x)		(x)
 #endif
 
+/*
+ * Bodies that are compiled into several kernel variants must be inlined.
+ */
+#if defined(__GNUC__)
+#define LZ77_INLINE		__inline__ __attribute__((always_inline))
+#else
+#define LZ77_INLINE
+#endif
+
 #define MAX_COPY		32
 #define MAX_LEN			264 /* 256 + 8 */
-#define MAX_DISTANCE	8192
+#define MAX_DISTANCE	LZ77_WINDOW_SIZE
 
-#define HASH_LOG		13
+#define HASH_LOG		LZ77_HASH_LOG
 #define HASH_SIZE		(1 << HASH_LOG)
 #define HASH_MASK		(HASH_SIZE - 1)
 
+/* format v2: 64 KB window, LZ4-style sequences */
+#define V2_MAX_DISTANCE	65535
+#define V2_MIN_MATCH	4
+#define V2_HASH_LOG		14
+#define V2_HASH_SIZE	(1 << V2_HASH_LOG)
+
+/* the top 3 bits of the first byte tell the format apart */
+#define LZ77_FORMAT(ip)	((*(const uint8_t*)(ip)) >> 5)
+
 #define LZ77_BOUND_CHECK(cond) \
 	if (unlikely(!(cond))) return 0;
 
@@ -96,26 +115,280 @@ static void lz77_memmove(uint8_t* dest, const uint8_t* src, uint32_t count)
 	}
 }
 
+/*
+ * Wild copies for the fast decoder loop: they copy whole 8, 16 or 32-byte
+ * blocks and may write up to 31 bytes beyond `end`, so the caller must
+ * leave that much room in the output.
+ */
+static LZ77_INLINE void lz77_wildcopy32(uint8_t* dest, const uint8_t* src, const uint8_t* end)
+{
+	do {
+		memcpy(dest, src, 32);
+		dest += 32;
+		src += 32;
+	} while (dest < end);
+}
+
+static LZ77_INLINE void lz77_wildcopy16(uint8_t* dest, const uint8_t* src, const uint8_t* end)
+{
+	do {
+		memcpy(dest, src, 16);
+		dest += 16;
+		src += 16;
+	} while (dest < end);
+}
+
+static LZ77_INLINE void lz77_wildcopy8(uint8_t* dest, const uint8_t* src, const uint8_t* end)
+{
+	do {
+		memcpy(dest, src, 8);
+		dest += 8;
+		src += 8;
+	} while (dest < end);
+}
+
+/*
+ * Copy a match of `len` bytes at `distance` behind `op`, where a distance
+ * below the block size makes source and destination overlap. For those, the first 8
+ * bytes are expanded byte-wise (distance below 8) so that the pattern can be
+ * continued from a point at least 8 bytes back.
+ */
+static LZ77_INLINE void lz77_wildmatch(uint8_t* op, const uint8_t* ref, uint32_t len)
+{
+	static const uint32_t inc[8] = {0, 1, 2, 1, 0, 4, 4, 4};
+	static const int32_t dec[8] = {0, 0, 0, -1, -4, 1, 2, 3};
+	uint32_t distance = op - ref;
+	uint8_t* end = op + len;
+
+	if (likely(distance >= 32)) {
+		lz77_wildcopy32(op, ref, end);
+		return;
+	}
+
+	if (distance >= 16) {
+		lz77_wildcopy16(op, ref, end);
+		return;
+	}
+
+	if (distance < 8) {
+		op[0] = ref[0];
+		op[1] = ref[1];
+		op[2] = ref[2];
+		op[3] = ref[3];
+		ref += inc[distance];
+		memcpy(op + 4, ref, 4);
+		ref -= dec[distance];
+	} else {
+		memcpy(op, ref, 8);
+		ref += 8;
+	}
+	op += 8;
+
+	if (op < end)
+		lz77_wildcopy8(op, ref, end);
+}
+
 static uint32_t lz77_readu32(const void* p)
 {
 	return *(const uint32_t*)p;
 }
 
-static uint32_t lz77_memcmp(const uint8_t* p, const uint8_t* q, const uint8_t* len)
+/*
+ * Match length kernels: number of equal bytes at p and q, stopping at limit
+ * (the end of q). All variants return the same result; the wide ones compare
+ * 8, 16 or 32 bytes at a time and find the first difference by counting
+ * trailing zeros, and fall back to bytes for the tail, so they never read
+ * beyond limit.
+ */
+static uint32_t lz77_match_length_bytes(const uint8_t* p, const uint8_t* q, const uint8_t* limit)
 {
-	const uint8_t* start = p;
+	const uint8_t* start = q;
 
-	if (lz77_readu32(p) == lz77_readu32(q)) {
-		p += 4;
-		q += 4;
+	while (q < limit && *p == *q) {
+		++p;
+		++q;
 	}
 
-	while (q < len) {
-		if (*p++ != *q++)
-			break;
+	return q - start;
+}
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LZ77_MATCH_WORD
+
+static uint32_t lz77_match_length_word(const uint8_t* p, const uint8_t* q, const uint8_t* limit)
+{
+	const uint8_t* start = q;
+
+	while (q + 8 <= limit) {
+		uint64_t diff = *(const uint64_t*)p ^ *(const uint64_t*)q;
+
+		if (diff)
+			return (q - start) + (__builtin_ctzll(diff) >> 3);
+		p += 8;
+		q += 8;
+	}
+
+	return (q - start) + lz77_match_length_bytes(p, q, limit);
+}
+#endif
+
+#if defined(__SSE2__) && defined(LZ77_MATCH_WORD)
+#include <emmintrin.h>
+#define LZ77_MATCH_SSE2
+
+static uint32_t lz77_match_length_sse2(const uint8_t* p, const uint8_t* q, const uint8_t* limit)
+{
+	const uint8_t* start = q;
+
+	while (q + 16 <= limit) {
+		__m128i a = _mm_loadu_si128((const __m128i*)p);
+		__m128i b = _mm_loadu_si128((const __m128i*)q);
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+
+		if (mask)
+			return (q - start) + __builtin_ctz(mask);
+		p += 16;
+		q += 16;
+	}
+
+	return (q - start) + lz77_match_length_word(p, q, limit);
+}
+#endif
+
+/*
+ * On x86 with GCC or clang the AVX2 variants are built even without -mavx2
+ * and only used when the CPU has AVX2, see lz77_select_kernels.
+ */
+#if defined(LZ77_MATCH_SSE2) && !defined(__AVX2__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LZ77_DISPATCH
+#define LZ77_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LZ77_TARGET_AVX2
+#endif
+
+#if (defined(__AVX2__) || defined(LZ77_DISPATCH)) && defined(LZ77_MATCH_SSE2)
+#include <immintrin.h>
+#define LZ77_MATCH_AVX2
+
+static LZ77_TARGET_AVX2 uint32_t lz77_match_length_avx2(const uint8_t* p, const uint8_t* q, const uint8_t* limit)
+{
+	const uint8_t* start = q;
+
+	while (q + 32 <= limit) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)p);
+		__m256i b = _mm256_loadu_si256((const __m256i*)q);
+		uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+		if (mask)
+			return (q - start) + __builtin_ctz(mask);
+		p += 32;
+		q += 32;
+	}
+
+	/* the SSE2 tail must not run with dirty upper halves */
+	_mm256_zeroupper();
+
+	return (q - start) + lz77_match_length_sse2(p, q, limit);
+}
+#endif
+
+static int lz77_decompress_generic(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout);
+#if defined(LZ77_MATCH_AVX2)
+static int lz77_decompress_avx2(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout);
+#endif
+
+/*
+ * Kernel variants, from the most portable to the widest. The library uses
+ * the widest one the CPU supports; the LZ77_KERNEL environment variable
+ * selects another one by name (for testing). All of them produce the same
+ * output.
+ */
+struct lz77_kernels {
+	const char* name;
+	uint32_t (*match_length)(const uint8_t* p, const uint8_t* q, const uint8_t* limit);
+	int (*decompress)(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout);
+};
+
+static const struct lz77_kernels lz77_kernel_table[] = {
+	{"bytes", lz77_match_length_bytes, lz77_decompress_generic},
+#if defined(LZ77_MATCH_WORD)
+	{"word", lz77_match_length_word, lz77_decompress_generic},
+#endif
+#if defined(LZ77_MATCH_SSE2)
+	{"sse2", lz77_match_length_sse2, lz77_decompress_generic},
+#endif
+#if defined(LZ77_MATCH_AVX2)
+	{"avx2", lz77_match_length_avx2, lz77_decompress_avx2},
+#endif
+};
+
+#define LZ77_KERNEL_COUNT	(sizeof(lz77_kernel_table) / sizeof(lz77_kernel_table[0]))
+
+/* until the CPU is checked, use the widest variant that needs no check */
+#if defined(LZ77_DISPATCH)
+static const struct lz77_kernels* lz77_kernels = &lz77_kernel_table[LZ77_KERNEL_COUNT - 2];
+#else
+static const struct lz77_kernels* lz77_kernels = &lz77_kernel_table[LZ77_KERNEL_COUNT - 1];
+#endif
+
+static int lz77_kernel_supported(const struct lz77_kernels* kernels)
+{
+#if defined(LZ77_DISPATCH)
+	/* reads the cpuid feature bits, including OS support for AVX state */
+	if (!strcmp(kernels->name, "avx2")) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	(void)kernels;
+	return 1;
+}
+
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void lz77_select_kernels(void)
+{
+	const char* forced = getenv("LZ77_KERNEL");
+	int k;
+
+	for (k = LZ77_KERNEL_COUNT - 1; k >= 0; --k) {
+		if (forced && strcmp(forced, lz77_kernel_table[k].name))
+			continue;
+		if (lz77_kernel_supported(&lz77_kernel_table[k])) {
+			lz77_kernels = &lz77_kernel_table[k];
+			return;
+		}
+	}
+
+	/* unknown or unsupported variant: pick the best one */
+	if (forced) {
+		for (k = LZ77_KERNEL_COUNT - 1; k > 0 && !lz77_kernel_supported(&lz77_kernel_table[k]); --k)
+			;
+		lz77_kernels = &lz77_kernel_table[k];
 	}
+}
+
+const char* lz77_kernel_name(void)
+{
+	return lz77_kernels->name;
+}
+
+static uint32_t lz77_match_length(const uint8_t* p, const uint8_t* q, const uint8_t* limit)
+{
+	return lz77_kernels->match_length(p, q, limit);
+}
+
+/*
+ * Length code for lz77_match: the number of equal bytes plus one for the
+ * first differing byte, or all bytes up to len if there is no difference.
+ */
+static uint32_t lz77_memcmp(const uint8_t* p, const uint8_t* q, const uint8_t* len)
+{
+	uint32_t count = lz77_match_length(p, q, len);
 
-	return p - start;
+	return q + count < len ? count + 1 : count;
 }
 
 static uint8_t* lz77_match(uint32_t len, uint32_t distance, uint8_t* op)
@@ -162,20 +435,155 @@ static uint8_t* lz77_literals(uint32_t runs, const uint8_t* src, uint8_t* dest)
 	return dest;
 }
 
-int lz77_compress(const void* input, int length, void* output)
+/* histogram bucket: values in [2^i, 2^(i+1)) go to bucket i */
+static int lz77_stats_bucket(uint32_t v)
 {
-	const uint8_t* ip = (const uint8_t*)input;
-	const uint8_t* ip_start = ip;
+	int bucket = 0;
+
+	while (v >>= 1)
+		++bucket;
+
+	return bucket < LZ77_STATS_BUCKETS ? bucket : LZ77_STATS_BUCKETS - 1;
+}
+
+static void lz77_stats_match(lz77_stats* stats, uint32_t len, uint32_t distance)
+{
+	stats->matches++;
+	stats->match_bytes += len;
+	stats->length_histogram[lz77_stats_bucket(len)]++;
+	stats->distance_histogram[lz77_stats_bucket(distance)]++;
+	if (len > MAX_LEN)
+		stats->max_len_splits++;
+}
+
+/* distance in input bytes between the checks of a compression limit */
+#define CHECK_STEP		4096
+
+/*
+ * Compress `length` bytes at `input` into `output`. The hash table holds
+ * positions, and `input` starts at position `offset`. Entries that are
+ * MAX_DISTANCE or more behind the current position are ignored, so a table
+ * is reused without clearing it by moving `offset` past all of its entries.
+ * Entries within reach must be valid history in memory before `input`.
+ * A nonzero `maxout` makes it return 0 as soon as the output, projected from
+ * the part done so far, would end up larger than `maxout` bytes.
+ * With `stats` it also fills in the statistics; the body is inlined, so the
+ * plain compressor passes a constant NULL and carries no trace of them.
+ */
+static LZ77_INLINE int lz77_compress_body(uint32_t* htab, uint32_t offset, const uint8_t* input, int length, uint8_t* output,
+	int maxout, lz77_stats* stats)
+{
+	const uint8_t* ip = input;
 	const uint8_t* ip_bound = ip + length - 4; /* because readU32 */
 	const uint8_t* ip_limit = ip + length - 12 - 1;
-	uint8_t* op = (uint8_t*)output;
+	const uint8_t* ip_check = maxout && length > CHECK_STEP + 13 ? ip + CHECK_STEP : ip_limit;
+	uint8_t* op = output;
 
-	uint32_t htab[HASH_SIZE];
-	uint32_t seq, hash;
+	uint32_t seq, hash, pos;
 
-	/* initializes hash table */
-	for (hash = 0; hash < HASH_SIZE; ++hash)
-		htab[hash] = 0;
+	/* we start with literal copy */
+	const uint8_t* anchor = ip;
+	ip += 2;
+
+	/* main loop */
+	while (likely(ip < ip_limit)) {
+		const uint8_t* ref;
+		uint32_t distance, cmp;
+
+		/* find potential match */
+		do {
+			seq = lz77_readu32(ip) & 0xffffff;
+			hash = lz77_hash(seq);
+			pos = offset + (ip - input);
+			distance = pos - htab[hash];
+			htab[hash] = pos;
+			ref = ip - distance;
+			cmp = likely(distance < MAX_DISTANCE) ? lz77_readu32(ref) & 0xffffff : 0x1000000;
+
+			/* a slot that held 0 was empty: position 0 is never hashed */
+			if (stats && seq != cmp) {
+				if (distance < MAX_DISTANCE && distance != pos)
+					stats->hash_overwrites++;
+				else if (distance <= (uint32_t)(ip - input) && (lz77_readu32(ref) & 0xffffff) == seq)
+					stats->distance_rejects++;
+			}
+
+			if (unlikely(ip++ >= ip_check))
+				break;
+		} while (seq != cmp);
+
+		if (unlikely(ip >= ip_check)) {
+			if (ip >= ip_limit)
+				break;
+
+			/* checkpoint: give up if the output is on course to exceed maxout */
+			if ((uint64_t)(op - output + ip - anchor) * length > (uint64_t)(ip - input) * maxout)
+				return 0;
+			ip_check = ip_limit - ip > CHECK_STEP ? ip + CHECK_STEP : ip_limit;
+
+			if (seq != cmp)
+				continue;
+		}
+
+		--ip;
+
+		if (likely(ip > anchor)) {
+			op = lz77_literals(ip - anchor, anchor, op);
+		}
+
+		uint32_t len = lz77_memcmp(ref + 3, ip + 3, ip_bound);
+		op = lz77_match(len, distance, op);
+		if (stats) {
+			stats->literals += ip - anchor;
+			lz77_stats_match(stats, len + 2, distance);
+		}
+
+		/* update the hash at match boundary */
+		ip += len;
+		seq = lz77_readu32(ip);
+		hash = lz77_hash(seq & 0xffffff);
+		htab[hash] = offset + (ip++ - input);
+		seq >>= 8;
+		hash = lz77_hash(seq);
+		htab[hash] = offset + (ip++ - input);
+
+		anchor = ip;
+	}
+
+	uint32_t copy = input + length - anchor;
+	op = lz77_literals(copy, anchor, op);
+	if (stats)
+		stats->literals += copy;
+
+	if (maxout && op - output > maxout)
+		return 0;
+
+	return op - output;
+}
+
+static int lz77_compress_block(uint32_t* htab, uint32_t offset, const uint8_t* input, int length, uint8_t* output, int maxout)
+{
+	return lz77_compress_body(htab, offset, input, length, output, maxout, NULL);
+}
+
+/* the search step grows by one every 1 << SKIP_TRIGGER misses, up to SKIP_MAX */
+#define SKIP_TRIGGER	6
+#define SKIP_MAX		32
+
+/*
+ * lz77_compress_block with a match search that skips ahead: a counter that
+ * starts at `search` after every match is incremented on each miss, and the
+ * search moves on by counter >> SKIP_TRIGGER bytes, at most SKIP_MAX.
+ * Skipped positions are not hashed.
+ */
+static int lz77_compress_skip(uint32_t* htab, uint32_t offset, const uint8_t* input, int length, uint8_t* output, uint32_t search)
+{
+	const uint8_t* ip = input;
+	const uint8_t* ip_bound = ip + length - 4; /* because readU32 */
+	const uint8_t* ip_limit = ip + length - 12 - 1;
+	uint8_t* op = output;
+
+	uint32_t seq, hash, pos;
 
 	/* we start with literal copy */
 	const uint8_t* anchor = ip;
@@ -185,27 +593,29 @@ int lz77_compress(const void* input, int length, void* output)
 	while (likely(ip < ip_limit)) {
 		const uint8_t* ref;
 		uint32_t distance, cmp;
+		uint32_t misses = search;
+		uint32_t step;
 
 		/* find potential match */
 		do {
 			seq = lz77_readu32(ip) & 0xffffff;
 			hash = lz77_hash(seq);
-			ref = ip_start + htab[hash];
-			htab[hash] = ip - ip_start;
-			distance = ip - ref;
+			pos = offset + (ip - input);
+			distance = pos - htab[hash];
+			htab[hash] = pos;
+			ref = ip - distance;
 			cmp = likely(distance < MAX_DISTANCE) ? lz77_readu32(ref) & 0xffffff : 0x1000000;
 
-			if (unlikely(ip >= ip_limit))
+			if (seq == cmp)
 				break;
 
-			++ip;
-		} while (seq != cmp);
+			step = misses++ >> SKIP_TRIGGER;
+			ip += step < SKIP_MAX ? step : SKIP_MAX;
+		} while (likely(ip < ip_limit));
 
 		if (unlikely(ip >= ip_limit))
 			break;
 
-		--ip;
-
 		if (likely(ip > anchor)) {
 			op = lz77_literals(ip - anchor, anchor, op);
 		}
@@ -217,61 +627,1595 @@ int lz77_compress(const void* input, int length, void* output)
 		ip += len;
 		seq = lz77_readu32(ip);
 		hash = lz77_hash(seq & 0xffffff);
-		htab[hash] = ip++ - ip_start;
+		htab[hash] = offset + (ip++ - input);
 		seq >>= 8;
 		hash = lz77_hash(seq);
-		htab[hash] = ip++ - ip_start;
+		htab[hash] = offset + (ip++ - input);
 
 		anchor = ip;
 	}
 
-	uint32_t copy = (uint8_t*)input + length - anchor;
+	uint32_t copy = input + length - anchor;
 	op = lz77_literals(copy, anchor, op);
 
-	return op - (uint8_t*)output;
+	return op - output;
 }
 
-int lz77_decompress(const void* input, int length, void* output, int maxout)
+/*
+ * Hash chains: head[] has the most recent position for each hash, and
+ * chain[pos % MAX_DISTANCE] links every position to the previous one with
+ * the same hash. A link can only be overwritten by a position at least
+ * MAX_DISTANCE later, which is out of reach by then.
+ */
+struct lz77_chains {
+	uint32_t head[HASH_SIZE];
+	uint32_t chain[MAX_DISTANCE];
+};
+
+static void lz77_chain_insert(struct lz77_chains* chains, const uint8_t* input, uint32_t pos)
 {
-	const uint8_t* ip = (const uint8_t*)input;
-	const uint8_t* ip_limit = ip + length;
-	const uint8_t* ip_bound = ip_limit - 2;
-	uint8_t* op = (uint8_t*)output;
-	uint8_t* op_limit = op + maxout;
-	uint32_t ctrl = (*ip++) & 31;
+	uint32_t hash = lz77_hash(lz77_readu32(input + pos) & 0xffffff);
 
-	while (1) {
-		if (ctrl >= 32) {
-			uint32_t len = (ctrl >> 5) - 1;
-			uint32_t ofs = (ctrl & 31) << 8;
-			const uint8_t* ref = op - ofs - 1;
+	chains->chain[pos & (MAX_DISTANCE - 1)] = chains->head[hash];
+	chains->head[hash] = pos;
+}
 
-			if (len == 7 - 1) {
-				LZ77_BOUND_CHECK(ip <= ip_bound);
-				len += *ip++;
-			}
+/* longest match for position pos, looking at no more than depth candidates */
+static uint32_t lz77_chain_find(const struct lz77_chains* chains, const uint8_t* input, uint32_t pos,
+	const uint8_t* ip_bound, uint32_t depth, uint32_t nice, uint32_t* distance)
+{
+	const uint8_t* ip = input + pos;
+	uint32_t seq = lz77_readu32(ip) & 0xffffff;
+	uint32_t ref = chains->head[lz77_hash(seq)];
+	uint32_t best = 0;
+	uint32_t len, next;
 
-			ref -= *ip++;
-			len += 3;
-			LZ77_BOUND_CHECK(op + len <= op_limit);
-			LZ77_BOUND_CHECK(ref >= (uint8_t*)output);
-			lz77_memmove(op, ref, len);
-			op += len;
-		} else {
-			ctrl++;
-			LZ77_BOUND_CHECK(op + ctrl <= op_limit);
-			LZ77_BOUND_CHECK(ip + ctrl <= ip_limit);
-			lz77_memcpy(op, ip, ctrl);
-			ip += ctrl;
-			op += ctrl;
+	while (depth-- > 0 && ref < pos && pos - ref < MAX_DISTANCE) {
+		const uint8_t* p = input + ref;
+
+		if (p[best] == ip[best] && (lz77_readu32(p) & 0xffffff) == seq) {
+			len = 3 + lz77_match_length(p + 3, ip + 3, ip_bound);
+			if (len > best) {
+				best = len;
+				*distance = pos - ref;
+				if (best >= nice || ip + best >= ip_bound)
+					break;
+			}
 		}
 
-		if (unlikely(ip > ip_bound))
+		next = chains->chain[ref & (MAX_DISTANCE - 1)];
+		if (next >= ref)
 			break;
+		ref = next;
+	}
 
-		ctrl = *ip++;
+	return best;
+}
+
+/* search depth, lazy evaluation and "good enough" length for levels 2..9 */
+static const struct {
+	uint16_t depth;
+	uint16_t lazy;
+	uint16_t nice;
+} lz77_levels[LZ77_LEVEL_ULTRA] = {
+	{0, 0, 0}, {0, 0, 0},
+	{4, 0, 16}, {8, 0, 32}, {8, 1, 32}, {16, 1, 64},
+	{32, 1, 128}, {64, 1, 264}, {128, 1, 264}, {256, 1, 264}
+};
+
+/*
+ * Hash chain compressor: same token format as lz77_compress, but every
+ * position looks at up to `depth` earlier candidates, and with lazy matching
+ * a match is deferred by one byte if the next position has a longer one.
+ * `stats` may be NULL.
+ */
+static int lz77_compress_chain(const uint8_t* input, int length, uint8_t* output, int level, lz77_stats* stats)
+{
+	const uint8_t* ip_bound = input + length - 4; /* because readU32 */
+	const uint8_t* ip_limit = input + length - 12 - 1;
+	uint32_t depth = lz77_levels[level].depth;
+	uint32_t nice = lz77_levels[level].nice;
+	uint8_t* op = output;
+	struct lz77_chains chains;
+	uint32_t pos, anchor, hash;
+	uint32_t len, distance, len2, distance2;
+
+	for (hash = 0; hash < HASH_SIZE; ++hash)
+		chains.head[hash] = 0;
+	for (hash = 0; hash < MAX_DISTANCE; ++hash)
+		chains.chain[hash] = 0;
+
+	/* we start with literal copy */
+	anchor = 0;
+	if (length > 12 + 1 + 2) {
+		lz77_chain_insert(&chains, input, 0);
+		lz77_chain_insert(&chains, input, 1);
 	}
 
-	return op - (uint8_t*)output;
+	for (pos = 2; input + pos < ip_limit; ) {
+		len = lz77_chain_find(&chains, input, pos, ip_bound, depth, nice, &distance);
+		lz77_chain_insert(&chains, input, pos);
+
+		if (len < 3) {
+			++pos;
+			continue;
+		}
+
+		/* lazy matching: prefer a longer match starting at the next byte */
+		while (lz77_levels[level].lazy && len < nice && input + pos + 1 < ip_limit) {
+			len2 = lz77_chain_find(&chains, input, pos + 1, ip_bound, depth, nice, &distance2);
+			if (len2 <= len)
+				break;
+			lz77_chain_insert(&chains, input, ++pos);
+			len = len2;
+			distance = distance2;
+		}
+
+		if (pos > anchor)
+			op = lz77_literals(pos - anchor, input + anchor, op);
+		op = lz77_match(len - 2, distance, op);
+		if (stats) {
+			stats->literals += pos - anchor;
+			lz77_stats_match(stats, len, distance);
+		}
+
+		/* index the positions covered by the match */
+		for (anchor = pos + len, ++pos; pos < anchor && input + pos < ip_limit; ++pos)
+			lz77_chain_insert(&chains, input, pos);
+		pos = anchor;
+	}
+
+	op = lz77_literals(length - anchor, input + anchor, op);
+	if (stats)
+		stats->literals += length - anchor;
+
+	return op - output;
 }
 
+/*
+ * Binary tree match finder: for every hash bucket the positions of the
+ * window are kept in a binary search tree ordered by the bytes that follow
+ * them. Each lookup walks the tree from the newest position and re-links it
+ * with the current position as its new root, which yields the longest match
+ * within the window. The tree nodes live in a cyclic buffer of MAX_DISTANCE
+ * pairs, so a node is only reused once its position is out of reach.
+ */
+#define BT_NIL			0xffffffff
+#define BT_DEPTH		128
+#define OPT_SEGMENT		(32 * 1024)
+
+struct lz77_tree {
+	uint32_t head[HASH_SIZE];
+	uint32_t son[2 * MAX_DISTANCE];
+};
+
+static uint32_t lz77_tree_find(struct lz77_tree* tree, const uint8_t* input, uint32_t pos,
+	const uint8_t* ip_bound, uint32_t* distance)
+{
+	const uint8_t* ip = input + pos;
+	uint32_t hash = lz77_hash(lz77_readu32(ip) & 0xffffff);
+	uint32_t ref = tree->head[hash];
+	uint32_t* ptr0 = &tree->son[2 * (pos & (MAX_DISTANCE - 1)) + 1];
+	uint32_t* ptr1 = &tree->son[2 * (pos & (MAX_DISTANCE - 1))];
+	uint32_t max = ip_bound - ip;
+	uint32_t len0 = 0, len1 = 0;
+	uint32_t depth = BT_DEPTH;
+	uint32_t best = 0;
+
+	tree->head[hash] = pos;
+
+	while (1) {
+		uint32_t* pair;
+		const uint8_t* p;
+		uint32_t len;
+
+		if (ref == BT_NIL || pos - ref >= MAX_DISTANCE || depth-- == 0) {
+			*ptr0 = *ptr1 = BT_NIL;
+			break;
+		}
+
+		pair = &tree->son[2 * (ref & (MAX_DISTANCE - 1))];
+		p = input + ref;
+		len = len0 < len1 ? len0 : len1;
+
+		if (p[len] == ip[len]) {
+			len += lz77_match_length(p + len, ip + len, ip + max);
+			if (len > best) {
+				best = len;
+				*distance = pos - ref;
+			}
+			if (len == max) {
+				/* the new node takes over both subtrees */
+				*ptr1 = pair[0];
+				*ptr0 = pair[1];
+				break;
+			}
+		}
+
+		if (p[len] < ip[len]) {
+			*ptr1 = ref;
+			ptr1 = pair + 1;
+			ref = *ptr1;
+			len1 = len;
+		} else {
+			*ptr0 = ref;
+			ptr0 = pair;
+			ref = *ptr0;
+			len0 = len;
+		}
+	}
+
+	return best;
+}
+
+/* exact size in bytes of the tokens lz77_match emits for a match of len bytes */
+static uint32_t lz77_match_price(uint32_t len)
+{
+	uint32_t code = len - 2;
+	uint32_t price = 0;
+
+	while (code > MAX_LEN - 2) {
+		price += 3;
+		code -= MAX_LEN - 2;
+	}
+
+	return price + (code < 7 ? 2 : 3);
+}
+
+struct lz77_node {
+	uint32_t cost;
+	uint32_t run;
+	uint32_t len;
+	uint32_t distance;
+};
+
+/*
+ * Optimal parsing: the longest match of every position is found with the
+ * binary tree; since any prefix of a match is a match at the same distance
+ * and the price of a match only depends on its length, the best parse of a
+ * segment follows from a shortest path over the positions. A literal costs
+ * one byte plus the run header whenever it starts a new run of MAX_COPY.
+ * Segments are parsed one after the other; matches do not cross them.
+ * Returns 0 if the tree and the segment buffers cannot be allocated.
+ */
+static int lz77_compress_optimal(const uint8_t* input, int length, uint8_t* output, lz77_stats* stats)
+{
+	const uint8_t* ip_bound = input + length - 4; /* because readU32 */
+	const uint8_t* ip_limit = input + length - 12 - 1;
+	uint8_t* op = output;
+	struct lz77_tree* tree;
+	struct lz77_node* nodes;
+	uint32_t* longest;
+	uint32_t* longest_distance;
+	uint32_t start, end, pos, i, len, cost, limit;
+	uint32_t anchor = 0;
+	uint32_t run = 0;
+
+	tree = (struct lz77_tree*)malloc(sizeof(struct lz77_tree));
+	nodes = (struct lz77_node*)malloc((OPT_SEGMENT + 1) * sizeof(struct lz77_node));
+	longest = (uint32_t*)malloc(OPT_SEGMENT * sizeof(uint32_t));
+	longest_distance = (uint32_t*)malloc(OPT_SEGMENT * sizeof(uint32_t));
+	if (!tree || !nodes || !longest || !longest_distance) {
+		free(tree);
+		free(nodes);
+		free(longest);
+		free(longest_distance);
+		return 0;
+	}
+
+	for (i = 0; i < HASH_SIZE; ++i)
+		tree->head[i] = BT_NIL;
+
+	for (start = 0; start < (uint32_t)length; start = end) {
+		end = (uint32_t)length - start < OPT_SEGMENT ? (uint32_t)length : start + OPT_SEGMENT;
+
+		/* longest match at every position; the first byte is always a literal */
+		for (pos = start; pos < end; ++pos) {
+			longest[pos - start] = 0;
+			if (input + pos < ip_limit) {
+				len = lz77_tree_find(tree, input, pos, ip_bound, &longest_distance[pos - start]);
+				if (len >= 3 && pos > 0)
+					longest[pos - start] = len < end - pos ? len : end - pos;
+			}
+		}
+
+		/* shortest path, the literal run carries over from the last segment */
+		nodes[0].cost = 0;
+		nodes[0].run = run;
+		for (i = 1; i <= end - start; ++i)
+			nodes[i].cost = 0xffffffff;
+
+		for (i = 0; i < end - start; ++i) {
+			cost = nodes[i].cost + 1 + (nodes[i].run % MAX_COPY == 0);
+			if (cost < nodes[i + 1].cost) {
+				nodes[i + 1].cost = cost;
+				nodes[i + 1].run = nodes[i].run + 1;
+				nodes[i + 1].len = 0;
+			}
+
+			limit = longest[i] < MAX_LEN ? longest[i] : MAX_LEN;
+			for (len = 3; len <= longest[i]; len = len < limit ? len + 1 : longest[i] + 1) {
+				cost = nodes[i].cost + lz77_match_price(len);
+				if (cost < nodes[i + len].cost) {
+					nodes[i + len].cost = cost;
+					nodes[i + len].run = 0;
+					nodes[i + len].len = len;
+					nodes[i + len].distance = longest_distance[i];
+				}
+			}
+		}
+		run = nodes[end - start].run;
+
+		/* walk back, leaving at every match start the match that ends later */
+		for (i = end - start; i > 0; ) {
+			if (nodes[i].len) {
+				len = nodes[i].len;
+				i -= len;
+				longest[i] = len;
+				longest_distance[i] = nodes[i + len].distance;
+			} else {
+				--i;
+				longest[i] = 0;
+			}
+		}
+
+		for (i = 0; i < end - start; ) {
+			if (longest[i] == 0) {
+				++i;
+				continue;
+			}
+			if (start + i > anchor)
+				op = lz77_literals(start + i - anchor, input + anchor, op);
+			op = lz77_match(longest[i] - 2, longest_distance[i], op);
+			if (stats) {
+				stats->literals += start + i - anchor;
+				lz77_stats_match(stats, longest[i], longest_distance[i]);
+			}
+			i += longest[i];
+			anchor = start + i;
+		}
+	}
+
+	op = lz77_literals(length - anchor, input + anchor, op);
+	if (stats)
+		stats->literals += length - anchor;
+
+	free(tree);
+	free(nodes);
+	free(longest);
+	free(longest_distance);
+
+	return op - output;
+}
+
+int lz77_compress_level(const void* input, int length, void* output, int level)
+{
+	if (level < LZ77_LEVEL_MIN)
+		level = LZ77_LEVEL_MIN;
+	if (level > LZ77_LEVEL_MAX)
+		level = LZ77_LEVEL_MAX;
+
+	if (level == 1)
+		return lz77_compress(input, length, output);
+
+	if (level == LZ77_LEVEL_ULTRA)
+		return lz77_compress_optimal((const uint8_t*)input, length, (uint8_t*)output, NULL);
+
+	return lz77_compress_chain((const uint8_t*)input, length, (uint8_t*)output, level, NULL);
+}
+
+void lz77_stats_init(lz77_stats* stats)
+{
+	memset(stats, 0, sizeof(lz77_stats));
+}
+
+int lz77_compress_ex(const void* input, int length, void* output, int level, lz77_stats* stats)
+{
+	lz77_cctx ctx;
+
+	if (!stats)
+		return lz77_compress_level(input, length, output, level);
+
+	if (level < LZ77_LEVEL_MIN)
+		level = LZ77_LEVEL_MIN;
+	if (level > LZ77_LEVEL_MAX)
+		level = LZ77_LEVEL_MAX;
+
+	if (level == LZ77_LEVEL_ULTRA)
+		return lz77_compress_optimal((const uint8_t*)input, length, (uint8_t*)output, stats);
+
+	if (level > 1)
+		return lz77_compress_chain((const uint8_t*)input, length, (uint8_t*)output, level, stats);
+
+	/* as lz77_compress: a cleared table and position 0 */
+	lz77_cctx_init(&ctx);
+
+	return lz77_compress_body((uint32_t*)ctx.htab, 0, (const uint8_t*)input, length, (uint8_t*)output, 0, stats);
+}
+
+/*
+ * Reusable context: instead of clearing the hash table, every call starts
+ * MAX_DISTANCE positions after the end of the previous one, which puts all
+ * old entries out of reach. The table is only cleared when the positions
+ * would wrap around.
+ */
+void lz77_cctx_init(lz77_cctx* ctx)
+{
+	uint32_t hash;
+
+	for (hash = 0; hash < HASH_SIZE; ++hash)
+		ctx->htab[hash] = 0;
+
+	ctx->offset = 0;
+}
+
+int lz77_compress_limit(lz77_cctx* ctx, const void* input, int length, void* output, int maxout)
+{
+	uint32_t offset = ctx->offset;
+
+	if (unlikely(offset > 0xffffffffU - MAX_DISTANCE - (uint32_t)length)) {
+		lz77_cctx_init(ctx);
+		offset = 0;
+	}
+	ctx->offset = offset + length + MAX_DISTANCE;
+
+	/* a cleared table points every slot at position 0; do the same here */
+	if (length >= 4)
+		ctx->htab[lz77_hash(lz77_readu32(input) & 0xffffff)] = offset;
+
+	return lz77_compress_block((uint32_t*)ctx->htab, offset, (const uint8_t*)input, length, (uint8_t*)output, maxout);
+}
+
+int lz77_compress_cctx(lz77_cctx* ctx, const void* input, int length, void* output)
+{
+	return lz77_compress_limit(ctx, input, length, output, 0);
+}
+
+int lz77_compress(const void* input, int length, void* output)
+{
+	lz77_cctx ctx;
+
+	lz77_cctx_init(&ctx);
+
+	return lz77_compress_cctx(&ctx, input, length, output);
+}
+
+int lz77_compress_fast(const void* input, int length, void* output, int acceleration)
+{
+	lz77_cctx ctx;
+	int size;
+
+	if (acceleration <= 1)
+		return lz77_compress(input, length, output);
+	if (acceleration > LZ77_ACCELERATION_MAX)
+		acceleration = LZ77_ACCELERATION_MAX;
+
+	lz77_cctx_init(&ctx);
+	size = lz77_compress_skip((uint32_t*)ctx.htab, 0, (const uint8_t*)input, length, (uint8_t*)output,
+		(acceleration - 1) << SKIP_TRIGGER);
+	if (size <= length)
+		return size;
+
+	/*
+	 * The skipping search grew the data, as it does on small inputs: compress
+	 * again without skipping, giving up early if that does not shrink either,
+	 * and store the data as literals then.
+	 */
+	lz77_cctx_init(&ctx);
+	size = lz77_compress_limit(&ctx, input, length, output, length);
+	if (size > 0)
+		return size;
+
+	return lz77_literals(length, (const uint8_t*)input, (uint8_t*)output) - (uint8_t*)output;
+}
+
+/*
+ * Format v2 starts with a marker byte (1 << 5), so that the first byte of
+ * the block tells it apart from v1, whose first token is always a literal
+ * run below 32. Then follow sequences of
+ *
+ *   token      high nibble: literal count, low nibble: match length - 4
+ *   [count]    if a nibble is 15, bytes of 255 and a final byte < 255 are
+ *              added to it
+ *   literals
+ *   distance   16-bit little endian, 1..65535
+ *   [length]
+ *
+ * The last sequence holds literals only and ends the block.
+ */
+static uint32_t lz77_hash_v2(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - V2_HASH_LOG);
+}
+
+static uint8_t* lz77_length_v2(uint32_t len, uint8_t* op)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t* lz77_sequence_v2(uint32_t runs, const uint8_t* src, uint32_t len, uint32_t distance, uint8_t* op)
+{
+	uint8_t* token = op++;
+
+	*token = (runs < 15 ? runs : 15) << 4;
+	if (runs >= 15)
+		op = lz77_length_v2(runs - 15, op);
+	lz77_memcpy(op, src, runs);
+	op += runs;
+
+	if (len == 0)
+		return op;
+
+	len -= V2_MIN_MATCH;
+	*token |= len < 15 ? len : 15;
+	*op++ = distance & 255;
+	*op++ = distance >> 8;
+	if (len >= 15)
+		op = lz77_length_v2(len - 15, op);
+
+	return op;
+}
+
+int lz77_compress_v2(const void* input, int length, void* output)
+{
+	const uint8_t* ip = (const uint8_t*)input;
+	const uint8_t* ip_start = ip;
+	const uint8_t* ip_bound = ip + length - 5;
+	const uint8_t* ip_limit = ip + length - 12;
+	const uint8_t* anchor = ip;
+	uint8_t* op = (uint8_t*)output;
+
+	uint32_t htab[V2_HASH_SIZE];
+	uint32_t seq, hash;
+
+	/* initializes hash table */
+	for (hash = 0; hash < V2_HASH_SIZE; ++hash)
+		htab[hash] = 0;
+
+	*op++ = (LZ77_FORMAT_V2 - 1) << 5;
+	if (length < 13)
+		return lz77_sequence_v2(length, anchor, 0, 0, op) - (uint8_t*)output;
+
+	/* main loop */
+	for (++ip; ip < ip_limit; ) {
+		const uint8_t* ref;
+		uint32_t len;
+
+		seq = lz77_readu32(ip);
+		hash = lz77_hash_v2(seq);
+		ref = ip_start + htab[hash];
+		htab[hash] = ip - ip_start;
+
+		if (ref >= ip || ip - ref > V2_MAX_DISTANCE || lz77_readu32(ref) != seq) {
+			++ip;
+			continue;
+		}
+
+		len = V2_MIN_MATCH + lz77_match_length(ref + V2_MIN_MATCH, ip + V2_MIN_MATCH, ip_bound);
+		op = lz77_sequence_v2(ip - anchor, anchor, len, ip - ref, op);
+
+		/* update the hash at match boundary */
+		ip += len;
+		htab[lz77_hash_v2(lz77_readu32(ip - 2))] = ip - 2 - ip_start;
+		anchor = ip;
+	}
+
+	op = lz77_sequence_v2(ip_start + length - anchor, anchor, 0, 0, op);
+
+	return op - (uint8_t*)output;
+}
+
+static int lz77_decompress_v2(const void* input, int length, void* output, int maxout)
+{
+	const uint8_t* ip = (const uint8_t*)input + 1;
+	const uint8_t* ip_limit = (const uint8_t*)input + length;
+	uint8_t* op = (uint8_t*)output;
+	uint8_t* op_limit = op + maxout;
+
+	while (1) {
+		uint32_t token, runs, len, distance;
+
+		LZ77_BOUND_CHECK(ip < ip_limit);
+		token = *ip++;
+
+		runs = token >> 4;
+		if (runs == 15) {
+			do {
+				LZ77_BOUND_CHECK(ip < ip_limit);
+				runs += *ip;
+			} while (*ip++ == 255);
+		}
+		LZ77_BOUND_CHECK(runs <= (uint32_t)(op_limit - op));
+		LZ77_BOUND_CHECK(runs <= (uint32_t)(ip_limit - ip));
+		lz77_memcpy(op, ip, runs);
+		ip += runs;
+		op += runs;
+
+		/* the last sequence has no match */
+		if (ip == ip_limit)
+			break;
+
+		LZ77_BOUND_CHECK(ip + 2 <= ip_limit);
+		distance = ip[0] + (ip[1] << 8);
+		ip += 2;
+
+		len = token & 15;
+		if (len == 15) {
+			do {
+				LZ77_BOUND_CHECK(ip < ip_limit);
+				len += *ip;
+			} while (*ip++ == 255);
+		}
+		len += V2_MIN_MATCH;
+
+		LZ77_BOUND_CHECK(distance > 0 && distance <= (uint32_t)(op - (uint8_t*)output));
+		LZ77_BOUND_CHECK(len <= (uint32_t)(op_limit - op));
+		lz77_memmove(op, op - distance, len);
+		op += len;
+	}
+
+	return op - (uint8_t*)output;
+}
+
+/*
+ * Room the fast decoder loop needs in front of it: the longest token plus
+ * what a wild copy may overrun, on both the input and the output side.
+ */
+#define FAST_INPUT		(1 + MAX_COPY + 16)
+#define FAST_OUTPUT		(MAX_LEN + 16 + MAX_COPY)
+
+/*
+ * Decompress into `output`; matches may reach up to `window_size` bytes
+ * before `output` into `window`, which holds the preceding history.
+ *
+ * Tokens far from the end of both buffers are decoded by a fast loop that
+ * only checks the match distance and uses wild copies; the last bytes go
+ * through the careful loop that checks every bound.
+ */
+static LZ77_INLINE int lz77_decompress_fast(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout)
+{
+	const uint8_t* ip = (const uint8_t*)input;
+	const uint8_t* ip_limit = ip + length;
+	const uint8_t* ip_bound = ip_limit - 2;
+	const uint8_t* ip_fast = length > FAST_INPUT ? ip_limit - FAST_INPUT : ip;
+	uint8_t* op = (uint8_t*)output;
+	uint8_t* op_limit = op + maxout;
+	uint8_t* op_fast = maxout > FAST_OUTPUT ? op_limit - FAST_OUTPUT : op;
+	uint32_t ctrl = (*ip++) & 31;
+
+	while (likely(ip < ip_fast && op < op_fast)) {
+		if (ctrl >= 32) {
+			uint32_t len = (ctrl >> 5) - 1;
+			uint32_t ofs = (ctrl & 31) << 8;
+			const uint8_t* ref = op - ofs - 1;
+
+			if (len == 7 - 1)
+				len += *ip++;
+
+			ref -= *ip++;
+			len += 3;
+			if (unlikely(ref < (uint8_t*)output)) {
+				uint32_t back = (uint8_t*)output - ref;
+				uint32_t count = back < len ? back : len;
+
+				LZ77_BOUND_CHECK(back <= window_size);
+				lz77_memcpy(op, window + window_size - back, count);
+				op += count;
+				len -= count;
+				lz77_memmove(op, (uint8_t*)output, len);
+			} else {
+				lz77_wildmatch(op, ref, len);
+			}
+			op += len;
+		} else {
+			ctrl++;
+			memcpy(op, ip, MAX_COPY);
+			ip += ctrl;
+			op += ctrl;
+		}
+
+		ctrl = *ip++;
+	}
+
+	while (1) {
+		if (ctrl >= 32) {
+			uint32_t len = (ctrl >> 5) - 1;
+			uint32_t ofs = (ctrl & 31) << 8;
+			const uint8_t* ref = op - ofs - 1;
+
+			if (len == 7 - 1) {
+				LZ77_BOUND_CHECK(ip <= ip_bound);
+				len += *ip++;
+			}
+
+			ref -= *ip++;
+			len += 3;
+			LZ77_BOUND_CHECK(op + len <= op_limit);
+			if (unlikely(ref < (uint8_t*)output)) {
+				/* the match starts in the history window */
+				uint32_t back = (uint8_t*)output - ref;
+				uint32_t count = back < len ? back : len;
+
+				LZ77_BOUND_CHECK(back <= window_size);
+				lz77_memcpy(op, window + window_size - back, count);
+				op += count;
+				len -= count;
+				ref = (uint8_t*)output;
+			}
+			lz77_memmove(op, ref, len);
+			op += len;
+		} else {
+			ctrl++;
+			LZ77_BOUND_CHECK(op + ctrl <= op_limit);
+			LZ77_BOUND_CHECK(ip + ctrl <= ip_limit);
+			lz77_memcpy(op, ip, ctrl);
+			ip += ctrl;
+			op += ctrl;
+		}
+
+		if (unlikely(ip > ip_bound))
+			break;
+
+		ctrl = *ip++;
+	}
+
+	return op - (uint8_t*)output;
+}
+
+/* the same decoder, compiled once per kernel variant */
+static int lz77_decompress_generic(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout)
+{
+	return lz77_decompress_fast(window, window_size, input, length, output, maxout);
+}
+
+#if defined(LZ77_MATCH_AVX2)
+static LZ77_TARGET_AVX2 int lz77_decompress_avx2(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout)
+{
+	return lz77_decompress_fast(window, window_size, input, length, output, maxout);
+}
+#endif
+
+static int lz77_decompress_block(const uint8_t* window, uint32_t window_size, const void* input, int length, void* output, int maxout)
+{
+	return lz77_kernels->decompress(window, window_size, input, length, output, maxout);
+}
+
+int lz77_decompress(const void* input, int length, void* output, int maxout)
+{
+	LZ77_BOUND_CHECK(length > 0);
+
+	switch (LZ77_FORMAT(input) + 1) {
+		case LZ77_FORMAT_V1:
+			return lz77_decompress_block(NULL, 0, input, length, output, maxout);
+		case LZ77_FORMAT_V2:
+			return lz77_decompress_v2(input, length, output, maxout);
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Streaming: the last MAX_DISTANCE bytes of the data seen so far are kept at
+ * the front of stream->buffer. The compressor appends each new block behind
+ * that window so that matches can cross the block boundary, and the hash
+ * table is carried over with its positions rebased onto the new window.
+ */
+void lz77_stream_init(lz77_stream* stream)
+{
+	uint32_t hash;
+
+	for (hash = 0; hash < HASH_SIZE; ++hash)
+		stream->htab[hash] = 0;
+
+	stream->buffer = NULL;
+	stream->capacity = 0;
+	stream->window_size = 0;
+}
+
+void lz77_stream_free(lz77_stream* stream)
+{
+	free(stream->buffer);
+	lz77_stream_init(stream);
+}
+
+static int lz77_stream_reserve(lz77_stream* stream, uint32_t size)
+{
+	uint8_t* buffer;
+
+	if (size <= stream->capacity)
+		return 1;
+
+	buffer = (uint8_t*)realloc(stream->buffer, size);
+	if (!buffer)
+		return 0;
+
+	stream->buffer = buffer;
+	stream->capacity = size;
+
+	return 1;
+}
+
+/* keep only the last MAX_DISTANCE bytes of the `size` bytes in the buffer */
+static uint32_t lz77_stream_slide(lz77_stream* stream, uint32_t size)
+{
+	uint32_t shift = size > MAX_DISTANCE ? size - MAX_DISTANCE : 0;
+
+	if (shift > 0)
+		memmove(stream->buffer, stream->buffer + shift, MAX_DISTANCE);
+	stream->window_size = size - shift;
+
+	return shift;
+}
+
+int lz77_compress_continue(lz77_stream* stream, const void* input, int length, void* output)
+{
+	uint32_t* htab = (uint32_t*)stream->htab;
+	uint32_t window_size = stream->window_size;
+	uint32_t shift, hash;
+	int result;
+
+	if (!lz77_stream_reserve(stream, window_size + length))
+		return 0;
+
+	memcpy(stream->buffer + window_size, input, length);
+	result = lz77_compress_block(htab, window_size, stream->buffer + window_size, length, (uint8_t*)output, 0);
+
+	/* rebase the hash table onto the new window; stale slots point at its start */
+	shift = lz77_stream_slide(stream, window_size + length);
+	for (hash = 0; hash < HASH_SIZE; ++hash)
+		htab[hash] = htab[hash] > shift ? htab[hash] - shift : 0;
+
+	return result;
+}
+
+int lz77_decompress_continue(lz77_stream* stream, const void* input, int length, void* output, int maxout)
+{
+	uint32_t window_size = stream->window_size;
+	uint32_t keep;
+	int result;
+
+	LZ77_BOUND_CHECK(length > 0 && LZ77_FORMAT(input) + 1 == LZ77_FORMAT_V1);
+
+	if (!lz77_stream_reserve(stream, MAX_DISTANCE * 2))
+		return 0;
+
+	result = lz77_decompress_block(stream->buffer, window_size, input, length, output, maxout);
+
+	/* append the tail of the new output to the window */
+	keep = result < MAX_DISTANCE ? result : MAX_DISTANCE;
+	memcpy(stream->buffer + window_size, (uint8_t*)output + result - keep, keep);
+	lz77_stream_slide(stream, window_size + keep);
+
+	return result;
+}
+
+/*
+ * Preset dictionary: the dictionary plays the part of the history before the
+ * input. Positions below dict->size in the hash table refer to the
+ * dictionary, the others to the input. Matches do not run from the
+ * dictionary into the input, which keeps both buffers apart.
+ */
+int lz77_dict_init(lz77_dict* dict, const void* data, int size)
+{
+	const uint8_t* src = (const uint8_t*)data;
+	uint32_t hash, pos;
+
+	if (size > MAX_DISTANCE) {
+		src += size - MAX_DISTANCE;
+		size = MAX_DISTANCE;
+	}
+	if (size < 0)
+		size = 0;
+
+	memcpy(dict->window, src, size);
+	memset(dict->window + size, 0, sizeof(dict->window) - size);
+	dict->size = size;
+
+	for (hash = 0; hash < HASH_SIZE; ++hash)
+		dict->htab[hash] = 0;
+	for (pos = 0; pos + 3 <= (uint32_t)size; ++pos)
+		dict->htab[lz77_hash(lz77_readu32(dict->window + pos) & 0xffffff)] = pos;
+
+	return size;
+}
+
+int lz77_compress_dict(const lz77_dict* dict, const void* input, int length, void* output)
+{
+	const uint8_t* ip = (const uint8_t*)input;
+	const uint8_t* ip_start = ip;
+	const uint8_t* ip_bound = ip + length - 4; /* because readU32 */
+	const uint8_t* ip_limit = ip + length - 12 - 1;
+	const uint8_t* window = dict->window;
+	uint32_t window_size = dict->size;
+	uint8_t* op = (uint8_t*)output;
+
+	uint32_t htab[HASH_SIZE];
+	uint32_t seq, hash, pos, ref, distance, len;
+
+	memcpy(htab, dict->htab, sizeof(htab));
+
+	/* we start with literal copy */
+	const uint8_t* anchor = ip;
+	ip += 2;
+
+	/* main loop */
+	while (likely(ip < ip_limit)) {
+		const uint8_t* p;
+		const uint8_t* bound;
+
+		seq = lz77_readu32(ip) & 0xffffff;
+		hash = lz77_hash(seq);
+		pos = window_size + (ip - ip_start);
+		ref = htab[hash];
+		htab[hash] = pos;
+		distance = pos - ref;
+
+		if (ref < window_size) {
+			/* the dictionary window is padded, so readU32 stays inside */
+			p = window + ref;
+			bound = ip + (window_size - ref) < ip_bound ? ip + (window_size - ref) : ip_bound;
+		} else {
+			p = ip_start + (ref - window_size);
+			bound = ip_bound;
+		}
+
+		if (distance == 0 || distance >= MAX_DISTANCE || bound < ip + 3 ||
+			(lz77_readu32(p) & 0xffffff) != seq) {
+			++ip;
+			continue;
+		}
+
+		if (ip > anchor)
+			op = lz77_literals(ip - anchor, anchor, op);
+
+		len = 3 + lz77_match_length(p + 3, ip + 3, bound);
+		op = lz77_match(len - 2, distance, op);
+
+		/* update the hash at match boundary */
+		ip += len;
+		htab[lz77_hash(lz77_readu32(ip - 2) & 0xffffff)] = pos + len - 2;
+		htab[lz77_hash(lz77_readu32(ip - 1) & 0xffffff)] = pos + len - 1;
+
+		anchor = ip;
+	}
+
+	op = lz77_literals(ip_start + length - anchor, anchor, op);
+
+	return op - (uint8_t*)output;
+}
+
+int lz77_decompress_dict(const lz77_dict* dict, const void* input, int length, void* output, int maxout)
+{
+	LZ77_BOUND_CHECK(length > 0 && LZ77_FORMAT(input) + 1 == LZ77_FORMAT_V1);
+
+	return lz77_decompress_block(dict->window, dict->size, input, length, output, maxout);
+}
+
+/*
+ * Entropy stage. A coded block starts with a 13-byte header:
+ *
+ *   marker     (LZ77_FORMAT_HUFF - 1) << 5, plus HUFF_LITERALS and
+ *              HUFF_TOKENS for the streams that are Huffman-coded
+ *   count      32-bit little endian: literal bytes of the v1 block
+ *   count      32-bit little endian: token bytes of the v1 block
+ *   size       32-bit little endian: bytes of the literal stream
+ *
+ * followed by the literal stream and the token stream, which runs to the end
+ * of the block. A raw stream is the bytes themselves. A coded stream starts
+ * with 128 bytes holding the code length of each byte value in a nibble (low
+ * nibble first, 0 for unused values) and the 32-bit little endian sizes of
+ * its first three substreams, followed by four substreams that code a
+ * quarter of the bytes each. A substream holds the canonical codes packed
+ * from the least significant bit of each byte on. Codes are at most
+ * HUFF_BITS long, so one lookup in a table of 2^HUFF_BITS entries decodes a
+ * code, and where two short codes fit into HUFF_BITS the entry holds both.
+ */
+#define HUFF_BITS		11
+#define HUFF_SIZE		(1 << HUFF_BITS)
+#define HUFF_HEADER		13
+#define HUFF_LENGTHS	128
+#define HUFF_LITERALS	1
+#define HUFF_TOKENS		2
+
+static uint32_t lz77_readle32(const uint8_t* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void lz77_writele32(uint8_t* p, uint32_t v)
+{
+	p[0] = v & 255;
+	p[1] = (v >> 8) & 255;
+	p[2] = (v >> 16) & 255;
+	p[3] = v >> 24;
+}
+
+static uint64_t lz77_readle64(const uint8_t* p)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	uint64_t value;
+
+	memcpy(&value, p, 8);
+	return value;
+#else
+	return (uint64_t)lz77_readle32(p) | ((uint64_t)lz77_readle32(p + 4) << 32);
+#endif
+}
+
+static int lz77_huff_compare(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Code lengths by Huffman's algorithm, computed in place on the sorted
+ * weights (Moffat and Katajainen). If the longest code exceeds HUFF_BITS,
+ * the weights are flattened by halving and the lengths computed again.
+ * Returns the number of bits the coded symbols take.
+ */
+static uint64_t lz77_huff_lengths(const uint32_t* freq, uint8_t* lengths)
+{
+	uint64_t sorted[256];
+	uint32_t a[256];
+	uint64_t bits = 0;
+	int n = 0, shift, i;
+	int root, leaf, next, avbl, used, depth;
+
+	memset(lengths, 0, 256);
+	for (i = 0; i < 256; ++i)
+		if (freq[i])
+			sorted[n++] = ((uint64_t)freq[i] << 8) | i;
+	if (n == 0)
+		return 0;
+	if (n == 1) {
+		lengths[sorted[0] & 255] = 1;
+		return sorted[0] >> 8;
+	}
+	qsort(sorted, n, sizeof(sorted[0]), lz77_huff_compare);
+
+	for (shift = 0;; ++shift) {
+		for (i = 0; i < n; ++i)
+			a[i] = (uint32_t)((sorted[i] >> 8) >> shift) + 1;
+
+		/* parent pointers, left to right */
+		a[0] += a[1];
+		root = 0;
+		leaf = 2;
+		for (next = 1; next < n - 1; ++next) {
+			if (leaf >= n || a[root] < a[leaf]) {
+				a[next] = a[root];
+				a[root++] = next;
+			} else {
+				a[next] = a[leaf++];
+			}
+			if (leaf >= n || (root < next && a[root] < a[leaf])) {
+				a[next] += a[root];
+				a[root++] = next;
+			} else {
+				a[next] += a[leaf++];
+			}
+		}
+
+		/* depths of the internal nodes, right to left */
+		a[n - 2] = 0;
+		for (next = n - 3; next >= 0; --next)
+			a[next] = a[a[next]] + 1;
+
+		/* depths of the leaves */
+		avbl = 1;
+		used = depth = 0;
+		root = n - 2;
+		next = n - 1;
+		while (avbl > 0) {
+			while (root >= 0 && (int)a[root] == depth) {
+				used++;
+				root--;
+			}
+			while (avbl > used) {
+				a[next--] = depth;
+				avbl--;
+			}
+			avbl = 2 * used;
+			depth++;
+			used = 0;
+		}
+
+		if (a[0] <= HUFF_BITS)
+			break;
+	}
+
+	for (i = 0; i < n; ++i) {
+		lengths[sorted[i] & 255] = a[i];
+		bits += (sorted[i] >> 8) * a[i];
+	}
+
+	return bits;
+}
+
+/* canonical codes for the lengths, bit-reversed for the LSB-first stream */
+static void lz77_huff_codes(const uint8_t* lengths, uint32_t* codes)
+{
+	uint32_t count[HUFF_BITS + 1];
+	uint32_t next[HUFF_BITS + 1];
+	uint32_t code = 0, reversed;
+	int i, b;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < 256; ++i)
+		count[lengths[i]]++;
+	count[0] = 0;
+	for (b = 1; b <= HUFF_BITS; ++b) {
+		code = (code + count[b - 1]) << 1;
+		next[b] = code;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		codes[i] = 0;
+		if (!lengths[i])
+			continue;
+		code = next[lengths[i]]++;
+		for (reversed = 0, b = 0; b < lengths[i]; ++b)
+			reversed |= ((code >> b) & 1) << (lengths[i] - 1 - b);
+		codes[i] = reversed;
+	}
+}
+
+/*
+ * Writes one stream of a block: the bytes themselves if `lengths` is NULL,
+ * otherwise the code lengths, the sizes of the first three substreams and
+ * the four substreams, each coding a quarter of the bytes.
+ */
+struct lz77_huff_writer {
+	const uint8_t* lengths;
+	uint32_t codes[256];
+	uint64_t bits;
+	uint32_t count;
+	uint32_t quarter;
+	uint32_t written;
+	uint32_t next;
+	uint32_t substream;
+	uint8_t* sizes;
+	uint8_t* start;
+	uint8_t* op;
+};
+
+static uint8_t* lz77_flush_bits(struct lz77_huff_writer* w)
+{
+	while (w->count > 0) {
+		*w->op++ = w->bits & 255;
+		w->bits >>= 8;
+		w->count = w->count > 8 ? w->count - 8 : 0;
+	}
+
+	return w->op;
+}
+
+/* end the current substream and record its size */
+static void lz77_huff_substream(struct lz77_huff_writer* w)
+{
+	lz77_flush_bits(w);
+	lz77_writele32(w->sizes + 4 * w->substream, w->op - w->start);
+	w->start = w->op;
+	w->substream++;
+	w->next += w->quarter;
+}
+
+static LZ77_INLINE void lz77_huff_put(struct lz77_huff_writer* w, const uint8_t* ip, uint32_t count)
+{
+	uint32_t i;
+
+	if (!w->lengths) {
+		memcpy(w->op, ip, count);
+		w->op += count;
+		return;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (w->written++ == w->next && w->substream < 3)
+			lz77_huff_substream(w);
+		w->bits |= (uint64_t)w->codes[ip[i]] << w->count;
+		w->count += w->lengths[ip[i]];
+		if (w->count >= 32) {
+			lz77_writele32(w->op, (uint32_t)w->bits);
+			w->op += 4;
+			w->bits >>= 32;
+			w->count -= 32;
+		}
+	}
+}
+
+static uint8_t* lz77_huff_write(const uint8_t* ip, const uint8_t* ip_end, int literals, const uint8_t* lengths, uint32_t count, uint8_t* op)
+{
+	struct lz77_huff_writer w;
+	uint32_t ctrl, i;
+
+	w.lengths = lengths;
+	w.bits = 0;
+	w.count = 0;
+	w.quarter = (count + 3) / 4;
+	w.written = 0;
+	w.next = w.quarter;
+	w.substream = 0;
+	if (lengths) {
+		for (i = 0; i < 256; i += 2)
+			*op++ = lengths[i] | (lengths[i + 1] << 4);
+		lz77_huff_codes(lengths, w.codes);
+		w.sizes = op;
+		op += 12;
+	}
+	w.start = w.op = op;
+
+	while (ip < ip_end) {
+		ctrl = *ip;
+		i = ctrl < 32 ? 1 : (ctrl >> 5) == 7 ? 3 : 2;
+		if (!literals)
+			lz77_huff_put(&w, ip, i);
+		ip += i;
+		if (ctrl < 32) {
+			if (literals)
+				lz77_huff_put(&w, ip, ctrl + 1);
+			ip += ctrl + 1;
+		}
+	}
+
+	if (lengths) {
+		while (w.substream < 3)
+			lz77_huff_substream(&w);
+		lz77_flush_bits(&w);
+	}
+
+	return w.op;
+}
+
+int lz77_huff_encode(const void* input, int length, void* output, int flags)
+{
+	const uint8_t* ip = (const uint8_t*)input;
+	const uint8_t* ip_end = ip + length;
+	uint8_t* op = (uint8_t*)output;
+	uint32_t lit_freq[256], tok_freq[256];
+	uint8_t lit_lengths[256], tok_lengths[256];
+	uint32_t literals = 0, tokens = 0, run, extra, i;
+	uint64_t lit_bits, tok_bits;
+	int coded = 0;
+	uint8_t* lp;
+
+	if (length <= 0 || LZ77_FORMAT(input) + 1 != LZ77_FORMAT_V1)
+		return 0;
+
+	/* split the v1 block and count the byte values of both streams */
+	memset(lit_freq, 0, sizeof(lit_freq));
+	memset(tok_freq, 0, sizeof(tok_freq));
+	while (ip < ip_end) {
+		uint32_t ctrl = *ip++;
+
+		tok_freq[ctrl]++;
+		tokens++;
+		if (ctrl < 32) {
+			run = ctrl + 1;
+			if (run > (uint32_t)(ip_end - ip))
+				return 0;
+			for (i = 0; i < run; ++i)
+				lit_freq[ip[i]]++;
+			literals += run;
+			ip += run;
+		} else {
+			extra = (ctrl >> 5) == 7 ? 2 : 1;
+			if (extra > (uint32_t)(ip_end - ip))
+				return 0;
+			for (i = 0; i < extra; ++i)
+				tok_freq[ip[i]]++;
+			tokens += extra;
+			ip += extra;
+		}
+	}
+
+	/* a stream is coded only if that makes it smaller */
+	lit_bits = lz77_huff_lengths(lit_freq, lit_lengths);
+	if (literals > 0 && HUFF_LENGTHS + 12 + (lit_bits + 7) / 8 + 3 < literals)
+		coded |= HUFF_LITERALS;
+	if (flags & LZ77_HUFF_TOKENS) {
+		tok_bits = lz77_huff_lengths(tok_freq, tok_lengths);
+		if (HUFF_LENGTHS + 12 + (tok_bits + 7) / 8 + 3 < tokens)
+			coded |= HUFF_TOKENS;
+	}
+
+	op[0] = ((LZ77_FORMAT_HUFF - 1) << 5) | coded;
+	lz77_writele32(op + 1, literals);
+	lz77_writele32(op + 5, tokens);
+	lp = op + HUFF_HEADER;
+	ip = (const uint8_t*)input;
+	op = lz77_huff_write(ip, ip_end, 1, coded & HUFF_LITERALS ? lit_lengths : NULL, literals, lp);
+	lz77_writele32((uint8_t*)output + 9, op - lp);
+	op = lz77_huff_write(ip, ip_end, 0, coded & HUFF_TOKENS ? tok_lengths : NULL, tokens, op);
+
+	return op - (uint8_t*)output;
+}
+
+/*
+ * Decoding table from the code lengths: each entry holds one or two symbols
+ * (bits 0-7 and 8-15), the bits they take together (16-19), the bits of the
+ * first one (20-23) and the number of symbols (24-25). Returns 0 if the
+ * lengths do not form a complete code.
+ */
+static int lz77_huff_table(const uint8_t* packed, uint32_t* table)
+{
+	uint8_t lengths[256];
+	uint32_t codes[256];
+	uint16_t single[HUFF_SIZE];
+	uint32_t kraft = 0, used = 0, i, step, first, second;
+
+	for (i = 0; i < 256; ++i) {
+		lengths[i] = (packed[i >> 1] >> ((i & 1) * 4)) & 15;
+		if (lengths[i] > HUFF_BITS)
+			return 0;
+		if (lengths[i]) {
+			kraft += HUFF_SIZE >> lengths[i];
+			used++;
+		}
+	}
+
+	/* a single value is coded with one bit */
+	if (used == 1 && kraft == HUFF_SIZE / 2) {
+		for (i = 0; lengths[i] == 0; ++i)
+			;
+		for (step = 0; step < HUFF_SIZE; ++step)
+			table[step] = i | (i << 8) | (2 << 16) | (1 << 20) | (2 << 24);
+		return 1;
+	}
+	if (kraft != HUFF_SIZE)
+		return 0;
+
+	lz77_huff_codes(lengths, codes);
+	for (i = 0; i < 256; ++i) {
+		if (!lengths[i])
+			continue;
+		for (step = codes[i]; step < HUFF_SIZE; step += 1 << lengths[i])
+			single[step] = i | (lengths[i] << 8);
+	}
+
+	for (i = 0; i < HUFF_SIZE; ++i) {
+		first = single[i];
+		second = single[i >> (first >> 8)];
+		if ((first >> 8) + (second >> 8) <= HUFF_BITS)
+			table[i] = (first & 255) | ((second & 255) << 8) | (((first >> 8) + (second >> 8)) << 16) | ((first >> 8) << 20) | (2 << 24);
+		else
+			table[i] = (first & 255) | ((first >> 8) << 16) | ((first >> 8) << 20) | (1 << 24);
+	}
+
+	return 1;
+}
+
+/*
+ * Decode `count` bytes of a coded stream of `size` bytes. The four
+ * substreams are decoded side by side so that their table lookups overlap:
+ * each bit buffer is refilled 8 bytes at a time, after which four lookups
+ * of up to two symbols each are safe. The end of every substream is decoded
+ * one symbol at a time.
+ */
+struct lz77_huff_reader {
+	const uint8_t* ip;
+	const uint8_t* ip_end;
+	uint8_t* op;
+	uint8_t* op_end;
+	uint64_t bits;
+	uint32_t nbits;
+};
+
+#define HUFF_REFILL(r) \
+	r.bits |= lz77_readle64(r.ip) << r.nbits; \
+	r.ip += (63 - r.nbits) >> 3; \
+	r.nbits |= 56;
+
+#define HUFF_DECODE_TWO(r) \
+	entry = table[r.bits & (HUFF_SIZE - 1)]; \
+	r.op[0] = entry & 255; \
+	r.op[1] = (entry >> 8) & 255; \
+	r.op += entry >> 24; \
+	r.bits >>= (entry >> 16) & 15; \
+	r.nbits -= (entry >> 16) & 15;
+
+/* rounds of the fast loop that stay within a substream: each reads at most
+ * 7 bytes ahead of the next refill and writes at most 8 */
+static uint32_t lz77_huff_rounds(const struct lz77_huff_reader* r, uint32_t rounds)
+{
+	uint32_t input = r->ip_end - r->ip >= 8 ? (r->ip_end - r->ip - 8) / 7 + 1 : 0;
+	uint32_t output = (r->op_end - r->op) / 8;
+
+	if (input < rounds)
+		rounds = input;
+	return output < rounds ? output : rounds;
+}
+
+static int lz77_huff_tail(const uint32_t* table, struct lz77_huff_reader* r)
+{
+	uint32_t padding = 0, entry, n;
+
+	while (r->op < r->op_end) {
+		while (r->nbits <= 56) {
+			if (r->ip < r->ip_end)
+				r->bits |= (uint64_t)*r->ip++ << r->nbits;
+			else
+				padding += 8;
+			r->nbits += 8;
+		}
+		entry = table[r->bits & (HUFF_SIZE - 1)];
+		*r->op++ = entry & 255;
+		n = (entry >> 20) & 15;
+		r->bits >>= n;
+		r->nbits -= n;
+	}
+
+	/* the zero bits added past the end must not have been used */
+	return r->ip == r->ip_end && r->nbits >= padding;
+}
+
+static int lz77_huff_stream(const uint8_t* ip, uint32_t size, uint8_t* op, uint32_t count)
+{
+	uint32_t table[HUFF_SIZE];
+	struct lz77_huff_reader r0, r1, r2, r3;
+	struct lz77_huff_reader* r[4];
+	uint32_t quarter = (count + 3) / 4, entry, skip, i;
+
+	if (size < HUFF_LENGTHS + 12 || !lz77_huff_table(ip, table))
+		return 0;
+
+	r[0] = &r0;
+	r[1] = &r1;
+	r[2] = &r2;
+	r[3] = &r3;
+	size -= HUFF_LENGTHS + 12;
+	ip += HUFF_LENGTHS;
+	skip = 12;
+	for (i = 0; i < 4; ++i) {
+		uint32_t bytes = i < 3 ? lz77_readle32(ip + 4 * i) : size;
+
+		if (bytes > size)
+			return 0;
+		size -= bytes;
+		r[i]->ip = ip + skip;
+		r[i]->ip_end = r[i]->ip + bytes;
+		skip += bytes;
+		r[i]->op = op;
+		op += count < quarter ? count : quarter;
+		count -= count < quarter ? count : quarter;
+		r[i]->op_end = op;
+		r[i]->bits = 0;
+		r[i]->nbits = 0;
+	}
+
+	for (;;) {
+		uint32_t rounds = lz77_huff_rounds(&r0, lz77_huff_rounds(&r1, lz77_huff_rounds(&r2, lz77_huff_rounds(&r3, ~0U))));
+
+		if (rounds == 0)
+			break;
+		while (rounds--) {
+			HUFF_REFILL(r0);
+			HUFF_REFILL(r1);
+			HUFF_REFILL(r2);
+			HUFF_REFILL(r3);
+			HUFF_DECODE_TWO(r0);
+			HUFF_DECODE_TWO(r1);
+			HUFF_DECODE_TWO(r2);
+			HUFF_DECODE_TWO(r3);
+			HUFF_DECODE_TWO(r0);
+			HUFF_DECODE_TWO(r1);
+			HUFF_DECODE_TWO(r2);
+			HUFF_DECODE_TWO(r3);
+			HUFF_DECODE_TWO(r0);
+			HUFF_DECODE_TWO(r1);
+			HUFF_DECODE_TWO(r2);
+			HUFF_DECODE_TWO(r3);
+			HUFF_DECODE_TWO(r0);
+			HUFF_DECODE_TWO(r1);
+			HUFF_DECODE_TWO(r2);
+			HUFF_DECODE_TWO(r3);
+		}
+	}
+
+	for (i = 0; i < 4; ++i)
+		if (!lz77_huff_tail(table, r[i]))
+			return 0;
+
+	return 1;
+}
+
+#undef HUFF_REFILL
+#undef HUFF_DECODE_TWO
+
+/*
+ * The v1 decoder with the tokens and the literals in separate streams.
+ * Literal runs and matches far from the end of the output use the wild
+ * copies of the fast decoder.
+ */
+static int lz77_decompress_split(const uint8_t* tp, uint32_t tokens, const uint8_t* lp, uint32_t literals, uint8_t* output, int maxout)
+{
+	const uint8_t* tp_end = tp + tokens;
+	const uint8_t* lp_end = lp + literals;
+	const uint8_t* lp_fast = literals > MAX_COPY ? lp_end - MAX_COPY : lp;
+	uint8_t* op = output;
+	uint8_t* op_end = op + maxout;
+	uint8_t* op_fast = maxout > FAST_OUTPUT ? op_end - FAST_OUTPUT : op;
+	uint32_t ctrl, len, ofs;
+
+	while (tp < tp_end) {
+		ctrl = *tp++;
+		if (ctrl < 32) {
+			ctrl++;
+			LZ77_BOUND_CHECK(ctrl <= (uint32_t)(lp_end - lp) && ctrl <= (uint32_t)(op_end - op));
+			if (likely(lp < lp_fast && op < op_fast))
+				memcpy(op, lp, MAX_COPY);
+			else
+				lz77_memcpy(op, lp, ctrl);
+			lp += ctrl;
+			op += ctrl;
+		} else {
+			len = (ctrl >> 5) + 2;
+			ofs = (ctrl & 31) << 8;
+			if (len == 7 + 2) {
+				LZ77_BOUND_CHECK(tp < tp_end);
+				len += *tp++;
+			}
+			LZ77_BOUND_CHECK(tp < tp_end);
+			ofs += *tp++;
+			LZ77_BOUND_CHECK(ofs < (uint32_t)(op - output) && len <= (uint32_t)(op_end - op));
+			if (likely(op < op_fast))
+				lz77_wildmatch(op, op - ofs - 1, len);
+			else
+				lz77_memmove(op, op - ofs - 1, len);
+			op += len;
+		}
+	}
+
+	LZ77_BOUND_CHECK(lp == lp_end);
+
+	return op - output;
+}
+
+int lz77_huff_decode(const void* input, int length, void* output, int maxout, void* scratch)
+{
+	const uint8_t* ip = (const uint8_t*)input;
+	const uint8_t* lp = ip + HUFF_HEADER;
+	const uint8_t* tp;
+	uint8_t* sp = (uint8_t*)scratch;
+	uint32_t literals, tokens, lit_size, tok_size;
+	int ok;
+
+	LZ77_BOUND_CHECK(length >= HUFF_HEADER && maxout > 0 && LZ77_FORMAT(input) + 1 == LZ77_FORMAT_HUFF);
+	literals = lz77_readle32(ip + 1);
+	tokens = lz77_readle32(ip + 5);
+	lit_size = lz77_readle32(ip + 9);
+
+	/* both decoded streams must fit into the scratch buffer */
+	LZ77_BOUND_CHECK(literals <= (uint32_t)maxout && tokens <= (uint32_t)LZ77_HUFF_SCRATCH(maxout) - literals);
+	LZ77_BOUND_CHECK(lit_size <= (uint32_t)length - HUFF_HEADER);
+	tp = lp + lit_size;
+	tok_size = length - HUFF_HEADER - lit_size;
+
+	if (ip[0] & HUFF_LITERALS) {
+		ok = lz77_huff_stream(lp, lit_size, sp, literals);
+		LZ77_BOUND_CHECK(ok);
+		lp = sp;
+		sp += literals;
+	} else {
+		LZ77_BOUND_CHECK(lit_size == literals);
+	}
+
+	if (ip[0] & HUFF_TOKENS) {
+		ok = lz77_huff_stream(tp, tok_size, sp, tokens);
+		LZ77_BOUND_CHECK(ok);
+		tp = sp;
+	} else {
+		LZ77_BOUND_CHECK(tok_size == tokens);
+	}
+
+	return lz77_decompress_split(tp, tokens, lp, literals, (uint8_t*)output, maxout);
+}
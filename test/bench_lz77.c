@@ -0,0 +1,611 @@
+/*
+ * Throughput benchmark: compresses and decompresses every file a number of
+ * times after a warm-up and reports the median and the 10th and 90th
+ * percentile speed, plus cycles per byte and cache misses where the kernel
+ * provides hardware counters through perf_event_open. The results can be
+ * written as JSON and compared against a stored baseline.
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define HAVE_PERF_EVENTS
+#endif
+
+#include "lz77.h"
+
+#define MAX_ITERATIONS 1000
+
+struct bench_options {
+	int level;
+	int entropy;
+	int warmup;
+	int iterations;
+	double threshold;
+	const char* json_file;
+	const char* baseline_file;
+};
+
+/* hardware counters of one phase: cycles and cache misses */
+struct counters {
+	int cycles;
+	int misses;
+};
+
+/* speeds in MB/s; counters are negative when not available */
+struct phase_result {
+	double median;
+	double p10;
+	double p90;
+	double cycles_per_byte;
+	double misses_per_mb;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#if defined(HAVE_PERF_EVENTS)
+static int perf_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_open(struct counters* counters)
+{
+	counters->cycles = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	counters->misses = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+}
+
+static void counters_close(struct counters* counters)
+{
+	if (counters->cycles >= 0)
+		close(counters->cycles);
+	if (counters->misses >= 0)
+		close(counters->misses);
+}
+
+static void counters_switch(const struct counters* counters, unsigned long request)
+{
+	if (counters->cycles >= 0)
+		ioctl(counters->cycles, request, 0);
+	if (counters->misses >= 0)
+		ioctl(counters->misses, request, 0);
+}
+
+static void counters_reset(const struct counters* counters)
+{
+	counters_switch(counters, PERF_EVENT_IOC_RESET);
+}
+
+static void counters_start(const struct counters* counters)
+{
+	counters_switch(counters, PERF_EVENT_IOC_ENABLE);
+}
+
+static void counters_stop(const struct counters* counters)
+{
+	counters_switch(counters, PERF_EVENT_IOC_DISABLE);
+}
+
+/* counter value, or -1 if the counter is not available */
+static double counter_read(int fd)
+{
+	uint64_t value;
+
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+		return -1;
+
+	return (double)value;
+}
+#else
+static void counters_open(struct counters* counters)
+{
+	counters->cycles = counters->misses = -1;
+}
+
+static void counters_close(struct counters* counters)
+{
+	(void)counters;
+}
+
+static void counters_reset(const struct counters* counters)
+{
+	(void)counters;
+}
+
+static void counters_start(const struct counters* counters)
+{
+	(void)counters;
+}
+
+static void counters_stop(const struct counters* counters)
+{
+	(void)counters;
+}
+
+static double counter_read(int fd)
+{
+	(void)fd;
+	return -1;
+}
+#endif
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted values */
+static double percentile(const double* values, int count, int p)
+{
+	return values[(p * (count - 1) + 50) / 100];
+}
+
+static void summarize(struct phase_result* result, double* speeds, int count, const struct counters* counters, double bytes)
+{
+	double cycles = counter_read(counters->cycles);
+	double misses = counter_read(counters->misses);
+
+	qsort(speeds, count, sizeof(double), compare_double);
+	result->median = percentile(speeds, count, 50);
+	result->p10 = percentile(speeds, count, 10);
+	result->p90 = percentile(speeds, count, 90);
+	result->cycles_per_byte = cycles >= 0 ? cycles / bytes : -1;
+	result->misses_per_mb = misses >= 0 ? misses * 1e6 / bytes : -1;
+}
+
+/* with the entropy stage, the v1 block goes through `scratch` first */
+static int compress_file(const struct bench_options* options, const uint8_t* input, int length, uint8_t* output, uint8_t* scratch)
+{
+	if (!options->entropy)
+		return lz77_compress_level(input, length, output, options->level);
+
+	length = lz77_compress_level(input, length, scratch, options->level);
+	return lz77_huff_encode(scratch, length, output, options->entropy > 1 ? LZ77_HUFF_TOKENS : 0);
+}
+
+static int decompress_file(const struct bench_options* options, const uint8_t* input, int length, uint8_t* output, int maxout, uint8_t* scratch)
+{
+	if (!options->entropy)
+		return lz77_decompress(input, length, output, maxout);
+
+	return lz77_huff_decode(input, length, output, maxout, scratch);
+}
+
+/*
+ * Run one file. Compression and decompression take turns in every
+ * iteration, and each phase has its own counters, enabled only while it
+ * runs. Returns the compressed size, or -1 on error.
+ */
+static long bench_file(const struct bench_options* options, const uint8_t* file_buffer, long file_size,
+	struct phase_result* compress, struct phase_result* decompress)
+{
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64 + LZ77_HUFF_OVERHEAD);
+	uint8_t* uncompressed_buffer = malloc(file_size + 1);
+	uint8_t* scratch = malloc(LZ77_HUFF_SCRATCH(file_size + 1));
+	double* compress_speeds = malloc(options->iterations * sizeof(double));
+	double* decompress_speeds = malloc(options->iterations * sizeof(double));
+	struct counters compress_counters, decompress_counters;
+	long compressed_size = -1;
+	double start;
+	int i;
+
+	if (!compressed_buffer || !uncompressed_buffer || !scratch || !compress_speeds || !decompress_speeds) {
+		printf("Error: not enough memory!\n");
+		goto done;
+	}
+
+	for (i = 0; i < options->warmup; ++i) {
+		compressed_size = compress_file(options, file_buffer, file_size, compressed_buffer, scratch);
+		decompress_file(options, compressed_buffer, compressed_size, uncompressed_buffer, file_size, scratch);
+	}
+
+	compressed_size = compress_file(options, file_buffer, file_size, compressed_buffer, scratch);
+	memset(uncompressed_buffer, '-', file_size);
+	if (decompress_file(options, compressed_buffer, compressed_size, uncompressed_buffer, file_size, scratch) != file_size ||
+		memcmp(file_buffer, uncompressed_buffer, file_size)) {
+		printf("Error: round-trip failed!\n");
+		compressed_size = -1;
+		goto done;
+	}
+
+	counters_open(&compress_counters);
+	counters_open(&decompress_counters);
+	counters_reset(&compress_counters);
+	counters_reset(&decompress_counters);
+
+	for (i = 0; i < options->iterations; ++i) {
+		counters_start(&compress_counters);
+		start = now();
+		compress_file(options, file_buffer, file_size, compressed_buffer, scratch);
+		compress_speeds[i] = file_size / (now() - start) / 1e6;
+		counters_stop(&compress_counters);
+
+		counters_start(&decompress_counters);
+		start = now();
+		decompress_file(options, compressed_buffer, compressed_size, uncompressed_buffer, file_size, scratch);
+		decompress_speeds[i] = file_size / (now() - start) / 1e6;
+		counters_stop(&decompress_counters);
+	}
+
+	summarize(compress, compress_speeds, options->iterations, &compress_counters, (double)file_size * options->iterations);
+	summarize(decompress, decompress_speeds, options->iterations, &decompress_counters, (double)file_size * options->iterations);
+	counters_close(&compress_counters);
+	counters_close(&decompress_counters);
+
+done:
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+	free(scratch);
+	free(compress_speeds);
+	free(decompress_speeds);
+
+	return compressed_size;
+}
+
+static uint8_t* load_file(const char* file_name, long* file_size)
+{
+	FILE* f = fopen(file_name, "rb");
+	uint8_t* buffer;
+
+	if (!f)
+		return NULL;
+
+	fseek(f, 0L, SEEK_END);
+	*file_size = ftell(f);
+	rewind(f);
+
+	buffer = malloc(*file_size + 1);
+	if (buffer && (long)fread(buffer, 1, *file_size, f) != *file_size) {
+		free(buffer);
+		buffer = NULL;
+	}
+	fclose(f);
+
+	return buffer;
+}
+
+static void json_string(FILE* f, const char* s)
+{
+	fputc('"', f);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void json_number(FILE* f, double value)
+{
+	if (value < 0)
+		fprintf(f, "null");
+	else
+		fprintf(f, "%.2f", value);
+}
+
+static void json_phase(FILE* f, const char* phase, const struct phase_result* result)
+{
+	fprintf(f, "\"%s\": {\"median\": %.2f, \"p10\": %.2f, \"p90\": %.2f, \"cycles_per_byte\": ",
+		phase, result->median, result->p10, result->p90);
+	json_number(f, result->cycles_per_byte);
+	fprintf(f, ", \"cache_misses_per_mb\": ");
+	json_number(f, result->misses_per_mb);
+	fprintf(f, "}");
+}
+
+/*
+ * The baseline is a JSON file written by this program, which puts every
+ * file on a line of its own; only the medians are read back.
+ */
+static int baseline_find(const char* baseline, const char* name, double* compress, double* decompress)
+{
+	const char* name_key = "{\"name\": \"";
+	const char* compress_key = "\"compress\": {\"median\": ";
+	const char* decompress_key = "\"decompress\": {\"median\": ";
+	const char* line = baseline;
+	const char* p;
+	size_t length = strlen(name);
+
+	while ((line = strstr(line, name_key)) != NULL) {
+		line += strlen(name_key);
+		if (strncmp(line, name, length) || line[length] != '"')
+			continue;
+		p = strstr(line, compress_key);
+		if (!p)
+			return 0;
+		*compress = strtod(p + strlen(compress_key), NULL);
+		p = strstr(line, decompress_key);
+		if (!p)
+			return 0;
+		*decompress = strtod(p + strlen(decompress_key), NULL);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* print and count the phases that are slower than the baseline */
+static int baseline_compare(const struct bench_options* options, const char* baseline, const char* name,
+	const struct phase_result* compress, const struct phase_result* decompress)
+{
+	double base_compress, base_decompress;
+	int regressions = 0;
+
+	if (!baseline_find(baseline, name, &base_compress, &base_decompress)) {
+		printf("%25s  not in baseline\n", name);
+		return 0;
+	}
+
+	if (compress->median < base_compress * (1 - options->threshold / 100)) {
+		printf("%25s  REGRESSION compress %.1f -> %.1f MB/s (%+.1f%%)\n", name, base_compress, compress->median,
+			100 * (compress->median / base_compress - 1));
+		regressions++;
+	}
+	if (decompress->median < base_decompress * (1 - options->threshold / 100)) {
+		printf("%25s  REGRESSION decompress %.1f -> %.1f MB/s (%+.1f%%)\n", name, base_decompress, decompress->median,
+			100 * (decompress->median / base_decompress - 1));
+		regressions++;
+	}
+
+	return regressions;
+}
+
+static char* read_text(const char* file_name)
+{
+	long size;
+	char* text = (char*)load_file(file_name, &size);
+
+	if (text)
+		text[size] = 0;
+
+	return text;
+}
+
+void usage(void)
+{
+	printf("bench_lz77: throughput benchmark for lz77\n");
+	printf("\n");
+	printf("Usage: bench_lz77 [options] [prefix/ | file]...\n");
+	printf("\n");
+	printf("A prefix ending in / runs the standard corpus below it (default ../dataset/).\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -l N      compression level %d..%d (default 1)\n", LZ77_LEVEL_MIN, LZ77_LEVEL_MAX);
+	printf("  -e N      entropy stage: 0 none, 1 literals, 2 literals and tokens (default 0)\n");
+	printf("  -n N      timed iterations per file (default 10)\n");
+	printf("  -w N      warm-up iterations per file (default 2)\n");
+	printf("  -j FILE   write the results as JSON\n");
+	printf("  -c FILE   compare against a baseline written with -j\n");
+	printf("  -t PCT    slowdown that counts as regression (default 5)\n");
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* names[] = {"canterbury/alice29.txt",
+		"canterbury/asyoulik.txt",
+		"canterbury/cp.html",
+		"canterbury/fields.c",
+		"canterbury/grammar.lsp",
+		"canterbury/kennedy.xls",
+		"canterbury/lcet10.txt",
+		"canterbury/plrabn12.txt",
+		"canterbury/ptt5",
+		"canterbury/sum",
+		"canterbury/xargs.1",
+		"silesia/dickens",
+		"silesia/mozilla",
+		"silesia/mr",
+		"silesia/nci",
+		"silesia/ooffice",
+		"silesia/osdb",
+		"silesia/reymont",
+		"silesia/samba",
+		"silesia/sao",
+		"silesia/webster",
+		"silesia/x-ray",
+		"silesia/xml",
+		"enwik/enwik8.txt"};
+	const int count = sizeof(names) / sizeof(names[0]);
+	const char* default_prefix = "../dataset/";
+	struct bench_options options;
+	struct phase_result compress, decompress;
+	const char** files;
+	char* baseline = NULL;
+	FILE* json = NULL;
+	int file_count = 0;
+	int regressions = 0;
+	int entries = 0;
+	int i, j;
+
+	options.level = LZ77_LEVEL_MIN;
+	options.entropy = 0;
+	options.warmup = 2;
+	options.iterations = 10;
+	options.threshold = 5;
+	options.json_file = NULL;
+	options.baseline_file = NULL;
+
+	files = malloc((argc + count) * sizeof(const char*));
+	if (!files)
+		return 1;
+
+	for (i = 1; i < argc; ++i) {
+		const char* argument = argv[i];
+
+		if (!strcmp(argument, "-h") || !strcmp(argument, "--help")) {
+			usage();
+			return 0;
+		}
+
+		if (argument[0] == '-' && argument[1] && !argument[2] && strchr("lenwjct", argument[1])) {
+			const char* value = argv[++i];
+
+			if (!value) {
+				printf("Error: option %s needs a value\n\n", argument);
+				return 1;
+			}
+			switch (argument[1]) {
+				case 'l':
+					options.level = atoi(value);
+					break;
+				case 'e':
+					options.entropy = atoi(value);
+					break;
+				case 'n':
+					options.iterations = atoi(value);
+					break;
+				case 'w':
+					options.warmup = atoi(value);
+					break;
+				case 'j':
+					options.json_file = value;
+					break;
+				case 'c':
+					options.baseline_file = value;
+					break;
+				case 't':
+					options.threshold = atof(value);
+					break;
+			}
+			continue;
+		}
+
+		if (argument[0] == '-') {
+			printf("Error: unknown option %s\n\n", argument);
+			usage();
+			return 1;
+		}
+
+		files[file_count++] = argument;
+	}
+
+	if (options.level < LZ77_LEVEL_MIN || options.level > LZ77_LEVEL_MAX ||
+		options.entropy < 0 || options.entropy > 2 ||
+		options.iterations < 1 || options.iterations > MAX_ITERATIONS || options.warmup < 0) {
+		printf("Error: invalid level, entropy stage or iteration count\n\n");
+		return 1;
+	}
+
+	if (file_count == 0)
+		files[file_count++] = default_prefix;
+
+	if (options.baseline_file) {
+		baseline = read_text(options.baseline_file);
+		if (!baseline) {
+			printf("Error: could not read baseline %s\n\n", options.baseline_file);
+			return 1;
+		}
+	}
+
+	if (options.json_file) {
+		json = fopen(options.json_file, "w");
+		if (!json) {
+			printf("Error: could not create %s\n\n", options.json_file);
+			return 1;
+		}
+		fprintf(json, "{\n  \"kernel\": \"%s\", \"level\": %d, \"entropy\": %d, \"warmup\": %d, \"iterations\": %d,\n  \"files\": [\n",
+			lz77_kernel_name(), options.level, options.entropy, options.warmup, options.iterations);
+	}
+
+	printf("Benchmark of lz77 level %d (kernel %s, entropy stage %d), %d warm-up + %d runs per file\n",
+		options.level, lz77_kernel_name(), options.entropy, options.warmup, options.iterations);
+	printf("MB/s as median [10th..90th percentile], cycles per byte and cache misses per MB if available\n\n");
+	printf("%25s %10s %8s  %-22s %-22s %s\n", "file", "size", "ratio", "compress", "decompress", "cyc/B  misses/MB");
+
+	for (i = 0; i < file_count; ++i) {
+		const char* argument = files[i];
+		size_t length = strlen(argument);
+		int prefix = length > 0 && argument[length - 1] == '/';
+
+		for (j = 0; j < (prefix ? count : 1); ++j) {
+			const char* name = prefix ? names[j] : argument;
+			char* file_name = malloc(length + strlen(name) + 1);
+			uint8_t* file_buffer;
+			long file_size, compressed_size;
+
+			strcpy(file_name, prefix ? argument : "");
+			strcat(file_name, name);
+			file_buffer = load_file(file_name, &file_size);
+			free(file_name);
+			if (!file_buffer || file_size == 0) {
+				printf("%25s  skipped (can not read)\n", name);
+				free(file_buffer);
+				continue;
+			}
+
+			compressed_size = bench_file(&options, file_buffer, file_size, &compress, &decompress);
+			free(file_buffer);
+			if (compressed_size < 0)
+				return 1;
+
+			printf("%25s %10ld %7.2f%%  %7.1f [%6.1f..%6.1f]  %7.1f [%6.1f..%6.1f]", name, file_size,
+				100.0 * compressed_size / file_size, compress.median, compress.p10, compress.p90,
+				decompress.median, decompress.p10, decompress.p90);
+			if (compress.cycles_per_byte >= 0)
+				printf("  %.2f/%.2f", compress.cycles_per_byte, decompress.cycles_per_byte);
+			if (compress.misses_per_mb >= 0)
+				printf("  %.0f/%.0f", compress.misses_per_mb, decompress.misses_per_mb);
+			printf("\n");
+
+			if (json) {
+				fprintf(json, "%s    {\"name\": ", entries ? ",\n" : "");
+				json_string(json, name);
+				fprintf(json, ", \"size\": %ld, \"compressed\": %ld, ", file_size, compressed_size);
+				json_phase(json, "compress", &compress);
+				fprintf(json, ", ");
+				json_phase(json, "decompress", &decompress);
+				fprintf(json, "}");
+			}
+			entries++;
+
+			if (baseline)
+				regressions += baseline_compare(&options, baseline, name, &compress, &decompress);
+		}
+	}
+	printf("\n");
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+	}
+
+	if (baseline) {
+		if (regressions)
+			printf("%d regression(s) of more than %.1f%% against %s\n\n", regressions, options.threshold, options.baseline_file);
+		else
+			printf("No regression against %s\n\n", options.baseline_file);
+		free(baseline);
+	}
+	free(files);
+
+	return regressions ? 2 : 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Match length kernel benchmark: collects the match candidates the compressor
+ * would look at in each file, then times every match length kernel of this
+ * build that the CPU supports on them.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz77_internal.h"
+
+#define MAX_PAIRS (1024 * 1024)
+#define REPEAT 20
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void bench_file(const char* name, const char* file_name)
+{
+	FILE* f = fopen(file_name, "rb");
+	if (!f) {
+		printf("Error: can not open %s!\n", file_name);
+		exit(1);
+	}
+	fseek(f, 0L, SEEK_END);
+	long file_size = ftell(f);
+	rewind(f);
+
+	uint8_t* file_buffer = malloc(file_size);
+	long read = fread(file_buffer, 1, file_size, f);
+	fclose(f);
+	if (read != file_size) {
+		printf("Error: only read %ld bytes!\n", read);
+		exit(1);
+	}
+
+	/* candidates as found by the single-slot hash table of lz77_compress */
+	uint32_t* refs = malloc(MAX_PAIRS * sizeof(uint32_t));
+	uint32_t* positions = malloc(MAX_PAIRS * sizeof(uint32_t));
+	uint32_t htab[HASH_SIZE];
+	long count = 0;
+	long i;
+
+	memset(htab, 0, sizeof(htab));
+	for (i = 0; i + 13 < file_size && count < MAX_PAIRS; ++i) {
+		uint32_t seq = lz77_readu32(file_buffer + i) & 0xffffff;
+		uint32_t hash = lz77_hash(seq);
+		uint32_t ref = htab[hash];
+
+		htab[hash] = i;
+		if (i - ref < MAX_DISTANCE && ref < i && (lz77_readu32(file_buffer + ref) & 0xffffff) == seq) {
+			refs[count] = ref + 3;
+			positions[count] = i + 3;
+			count++;
+		}
+	}
+
+	const uint8_t* limit = file_buffer + file_size - 4;
+	const int kernel_count = LZ77_KERNEL_COUNT;
+	double base_time = 0;
+	uint64_t base_sum = 0;
+	int k, r;
+
+	printf("%25s %8ld pairs", name, count);
+	for (k = 0; k < kernel_count; ++k) {
+		const struct lz77_kernels* kernels = &lz77_kernel_table[k];
+		uint64_t sum = 0;
+		double best = 1e30;
+
+		if (!lz77_kernel_supported(kernels))
+			continue;
+
+		for (r = 0; r < REPEAT; ++r) {
+			uint64_t run = 0;
+			double start = now();
+
+			for (i = 0; i < count; ++i)
+				run += kernels->match_length(file_buffer + refs[i], file_buffer + positions[i], limit);
+			start = now() - start;
+			if (start < best)
+				best = start;
+			sum = run;
+		}
+
+		if (k == 0) {
+			base_time = best;
+			base_sum = sum;
+			printf("  avg %6.2f", count ? (double)sum / count + 3 : 0.0);
+		} else if (sum != base_sum) {
+			printf("\nError on %s: kernel %s disagrees!\n", name, kernels->name);
+			exit(1);
+		}
+
+		printf("  %s %6.2f ns (%.2fx)", kernels->name, count ? best * 1e9 / count : 0.0, best > 0 ? base_time / best : 0.0);
+	}
+	printf("\n");
+
+	free(refs);
+	free(positions);
+	free(file_buffer);
+}
+
+int main(int argc, char** argv)
+{
+	const char* default_prefix = "../dataset/";
+	const char* names[] = {"canterbury/alice29.txt",
+		"canterbury/asyoulik.txt",
+		"canterbury/cp.html",
+		"canterbury/fields.c",
+		"canterbury/grammar.lsp",
+		"canterbury/kennedy.xls",
+		"canterbury/lcet10.txt",
+		"canterbury/plrabn12.txt",
+		"canterbury/ptt5",
+		"canterbury/sum",
+		"canterbury/xargs.1"};
+
+	const char* prefix = (argc == 2) ? argv[1] : default_prefix;
+
+	const int count = sizeof(names) / sizeof(names[0]);
+	int i;
+
+	printf("Benchmark of the match length kernels (ns per call, speedup over bytes)\n\n");
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		bench_file(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * Primitive microbenchmark: times the static helpers of the library one by
+ * one, in ns per call, over a sweep of lengths, match distances and working
+ * set sizes, to show which of them limits the throughput.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz77_internal.h"
+
+/* calls per measurement, and the best of RUNS measurements is taken */
+#define OPS (1 << 16)
+#define RUNS 7
+
+/* working set sizes swept by the copy benchmarks */
+#define MAX_SPAN (32 * 1024 * 1024)
+
+/* the room a call may need beyond its offset in the working set */
+#define SLACK (4 * 1024)
+
+static volatile uint32_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* scattered offsets in [0, span), so large spans miss the caches */
+static void make_offsets(uint32_t* offsets, uint32_t span, uint32_t align)
+{
+	uint32_t x = 2463534242U;
+	uint32_t i;
+
+	for (i = 0; i < OPS; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		offsets[i] = (x % (span / align)) * align;
+	}
+}
+
+static void report(const char* label, double best)
+{
+	printf("  %-28s %8.2f ns\n", label, best * 1e9 / OPS);
+}
+
+static void bench_hash(void)
+{
+	uint32_t* values = malloc(OPS * sizeof(uint32_t));
+	double best = 1e30;
+	uint32_t i;
+	int r;
+
+	make_offsets(values, 0xfffffff0U, 1);
+	for (r = 0; r < RUNS; ++r) {
+		uint32_t sum = 0;
+		double start = now();
+
+		for (i = 0; i < OPS; ++i)
+			sum += lz77_hash(values[i] & 0xffffff);
+		start = now() - start;
+		sink += sum;
+		if (start < best)
+			best = start;
+	}
+
+	printf("lz77_hash\n");
+	report("", best);
+	printf("\n");
+	free(values);
+}
+
+/* p and q agree on `length` bytes, then differ */
+static void bench_memcmp(uint8_t* buffer)
+{
+	const uint32_t lengths[] = {0, 1, 4, 8, 16, 32, 64, 128, 256, 1024};
+	const int count = sizeof(lengths) / sizeof(lengths[0]);
+	const uint8_t* p = buffer;
+	uint8_t* q = buffer + 2 * SLACK;
+	char label[64];
+	int k, r;
+
+	printf("lz77_memcmp (kernel %s)\n", lz77_kernel_name());
+	for (k = 0; k < count; ++k) {
+		double best = 1e30;
+		uint32_t i;
+
+		memcpy(q, p, lengths[k]);
+		q[lengths[k]] = p[lengths[k]] ^ 1;
+		for (r = 0; r < RUNS; ++r) {
+			uint32_t sum = 0;
+			double start = now();
+
+			for (i = 0; i < OPS; ++i)
+				sum += lz77_memcmp(p, q, q + SLACK);
+			start = now() - start;
+			sink += sum;
+			if (start < best)
+				best = start;
+		}
+		sprintf(label, "length %u", lengths[k]);
+		report(label, best);
+	}
+	printf("\n");
+}
+
+static void bench_copies(uint8_t* buffer, uint8_t* target, uint32_t* offsets)
+{
+	const uint32_t spans[] = {16 * 1024, 1024 * 1024, MAX_SPAN};
+	const uint32_t lengths[] = {1, 3, 4, 7, 8, 16, 31, 32};
+	const int span_count = sizeof(spans) / sizeof(spans[0]);
+	const int length_count = sizeof(lengths) / sizeof(lengths[0]);
+	char label[64];
+	int s, k, r;
+	uint32_t i;
+
+	printf("lz77_smallcopy / lz77_maxcopy\n");
+	for (s = 0; s < span_count; ++s) {
+		make_offsets(offsets, spans[s], 1);
+		for (k = 0; k < length_count; ++k) {
+			double best = 1e30;
+
+			for (r = 0; r < RUNS; ++r) {
+				double start = now();
+
+				for (i = 0; i < OPS; ++i)
+					lz77_smallcopy(target + offsets[OPS - 1 - i], buffer + offsets[i], lengths[k]);
+				start = now() - start;
+				if (start < best)
+					best = start;
+			}
+			sprintf(label, "smallcopy %2u, set %5u KB", lengths[k], spans[s] / 1024);
+			report(label, best);
+		}
+
+		{
+			double best = 1e30;
+
+			for (r = 0; r < RUNS; ++r) {
+				double start = now();
+
+				for (i = 0; i < OPS; ++i)
+					lz77_maxcopy(target + offsets[OPS - 1 - i], buffer + offsets[i]);
+				start = now() - start;
+				if (start < best)
+					best = start;
+			}
+			sprintf(label, "maxcopy, set %5u KB", spans[s] / 1024);
+			report(label, best);
+		}
+	}
+	printf("\n");
+	sink += target[offsets[0]];
+}
+
+/* overlapping copies as the decoder makes them: dest is `distance` past src */
+static void bench_memmove(uint8_t* target, uint32_t* offsets)
+{
+	const uint32_t lengths[] = {3, 8, 32, 264};
+	const uint32_t distances[] = {1, 2, 4, 8, 16, 64, 1024, 8192};
+	const int length_count = sizeof(lengths) / sizeof(lengths[0]);
+	const int distance_count = sizeof(distances) / sizeof(distances[0]);
+	char label[64];
+	int k, d, r;
+	uint32_t i;
+
+	make_offsets(offsets, 1024 * 1024, 1);
+	printf("lz77_memmove (set 1024 KB)\n");
+	for (k = 0; k < length_count; ++k) {
+		for (d = 0; d < distance_count; ++d) {
+			double best = 1e30;
+
+			for (r = 0; r < RUNS; ++r) {
+				double start = now();
+
+				for (i = 0; i < OPS; ++i) {
+					uint8_t* op = target + 8192 + offsets[i];
+
+					lz77_memmove(op, op - distances[d], lengths[k]);
+				}
+				start = now() - start;
+				if (start < best)
+					best = start;
+			}
+			sprintf(label, "length %3u, distance %4u", lengths[k], distances[d]);
+			report(label, best);
+		}
+	}
+	printf("\n");
+	sink += target[8192 + offsets[0]];
+}
+
+static void bench_literals(uint8_t* buffer, uint8_t* target, uint32_t* offsets)
+{
+	const uint32_t spans[] = {16 * 1024, 1024 * 1024, MAX_SPAN};
+	const uint32_t runs[] = {1, 4, 16, 32, 33, 100, 1000};
+	const int span_count = sizeof(spans) / sizeof(spans[0]);
+	const int run_count = sizeof(runs) / sizeof(runs[0]);
+	char label[64];
+	int s, k, r;
+	uint32_t i;
+
+	printf("lz77_literals\n");
+	for (s = 0; s < span_count; ++s) {
+		make_offsets(offsets, spans[s], 1);
+		for (k = 0; k < run_count; ++k) {
+			double best = 1e30;
+
+			for (r = 0; r < RUNS; ++r) {
+				double start = now();
+
+				for (i = 0; i < OPS; ++i)
+					lz77_literals(runs[k], buffer + offsets[i], target + offsets[OPS - 1 - i]);
+				start = now() - start;
+				if (start < best)
+					best = start;
+			}
+			sprintf(label, "run %4u, set %5u KB", runs[k], spans[s] / 1024);
+			report(label, best);
+		}
+	}
+	printf("\n");
+	sink += target[offsets[0]];
+}
+
+static void bench_match(uint8_t* target)
+{
+	const uint32_t lengths[] = {1, 6, 7, 100, 262, 1000};
+	const uint32_t distances[] = {1, 256, 8192};
+	const int length_count = sizeof(lengths) / sizeof(lengths[0]);
+	const int distance_count = sizeof(distances) / sizeof(distances[0]);
+	char label[64];
+	int k, d, r;
+	uint32_t i;
+
+	printf("lz77_match\n");
+	for (k = 0; k < length_count; ++k) {
+		for (d = 0; d < distance_count; ++d) {
+			double best = 1e30;
+
+			for (r = 0; r < RUNS; ++r) {
+				uint8_t* op = target;
+				double start = now();
+
+				/* at most 15 bytes per call here, so the output wraps every 4096 calls */
+				for (i = 0; i < OPS; ++i) {
+					op = lz77_match(lengths[k], distances[d], op);
+					if ((i & 4095) == 4095)
+						op = target;
+				}
+				start = now() - start;
+				sink += op[-1];
+				if (start < best)
+					best = start;
+			}
+			sprintf(label, "length %4u, distance %4u", lengths[k] + 2, distances[d]);
+			report(label, best);
+		}
+	}
+	printf("\n");
+}
+
+int main(void)
+{
+	uint8_t* buffer = malloc(MAX_SPAN + 2 * SLACK);
+	uint8_t* target = malloc(MAX_SPAN + 2 * SLACK);
+	uint32_t* offsets = malloc(OPS * sizeof(uint32_t));
+	uint32_t i;
+
+	if (!buffer || !target || !offsets) {
+		printf("Error: not enough memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < MAX_SPAN + 2 * SLACK; ++i) {
+		buffer[i] = (uint8_t)(i * 7 + (i >> 9));
+		target[i] = 0;
+	}
+
+	printf("Benchmark of the lz77 primitives (ns per call, best of %d runs of %d calls)\n\n", RUNS, OPS);
+	bench_hash();
+	bench_memcmp(buffer);
+	bench_copies(buffer, target, offsets);
+	bench_memmove(target, offsets);
+	bench_literals(buffer, target, offsets);
+	bench_match(target);
+
+	free(buffer);
+	free(target);
+	free(offsets);
+
+	return 0;
+}
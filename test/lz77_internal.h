@@ -0,0 +1,21 @@
+/*
+ * Internal test header: gives tests and benchmarks access to the static
+ * primitives of the library by compiling src/lz77.c into the including
+ * program. Include it from one file only and do not link src/lz77.c as well.
+ *
+ *   lz77_hash(v)                      hash of the low 3 bytes of v, < HASH_SIZE
+ *   lz77_memcmp(p, q, end)            match length code of q against p, q < end
+ *   lz77_smallcopy(dest, src, n)      copy of n <= MAX_COPY bytes
+ *   lz77_maxcopy(dest, src)           copy of exactly MAX_COPY bytes
+ *   lz77_memmove(dest, src, n)        forward copy that repeats src when the
+ *                                     two overlap, as matches need
+ *   lz77_literals(n, src, op)         literal runs for n bytes, returns new op
+ *   lz77_match(len, distance, op)     match tokens for len + 2 bytes at
+ *                                     distance, returns new op
+ */
+#ifndef LZ77_INTERNAL_H
+#define LZ77_INTERNAL_H
+
+#include "../src/lz77.c"
+
+#endif
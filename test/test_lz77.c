@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "lz77.h"
+#include "checksum.h"
 
 #define MAX_FILE_SIZE (100 * 1024 * 1024)
 #define LOG
@@ -98,6 +99,438 @@ void test_roundtrip_lz77(const char* name, const char* file_name)
 	return;
 }
 
+/* read a whole test file, or return NULL if it is too big */
+uint8_t* load_file(const char* name, const char* file_name, long* size)
+{
+	FILE* f = fopen(file_name, "rb");
+	if (!f) {
+		printf("Error: can not open %s!\n", file_name);
+		exit(1);
+	}
+	fseek(f, 0L, SEEK_END);
+	long file_size = ftell(f);
+	rewind(f);
+
+	if (file_size > MAX_FILE_SIZE) {
+		fclose(f);
+		printf("%25s %10ld [skipped, file too big]\n", name, file_size);
+		return NULL;
+	}
+
+	uint8_t* file_buffer = malloc(file_size);
+	long read = fread(file_buffer, 1, file_size, f);
+	fclose(f);
+	if (read != file_size) {
+		free(file_buffer);
+		printf("Error: only read %ld bytes!\n", read);
+		exit(1);
+	}
+
+	*size = file_size;
+	return file_buffer;
+}
+
+/* compress in fixed-size blocks through a stream, then decode them back */
+void test_roundtrip_stream(const char* name, const char* file_name)
+{
+	const int block_size = 64 * 1024;
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	/* every block is preceded by its compressed size */
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64 + (file_size / block_size + 1) * sizeof(int));
+	uint8_t* uncompressed_buffer = malloc(file_size + 1);
+	lz77_stream stream;
+	long pos, compressed_size = 0;
+	int block, chunk;
+
+	lz77_stream_init(&stream);
+	for (pos = 0; pos < file_size; pos += block) {
+		block = file_size - pos < block_size ? file_size - pos : block_size;
+		chunk = lz77_compress_continue(&stream, file_buffer + pos, block, compressed_buffer + compressed_size + sizeof(int));
+		memcpy(compressed_buffer + compressed_size, &chunk, sizeof(int));
+		compressed_size += sizeof(int) + chunk;
+	}
+	lz77_stream_free(&stream);
+
+	memset(uncompressed_buffer, '-', file_size);
+	lz77_stream_init(&stream);
+	long ip = 0;
+	for (pos = 0; pos < file_size; pos += block) {
+		block = file_size - pos < block_size ? file_size - pos : block_size;
+		memcpy(&chunk, compressed_buffer + ip, sizeof(int));
+		if (lz77_decompress_continue(&stream, compressed_buffer + ip + sizeof(int), chunk, uncompressed_buffer + pos, block) != block) {
+			printf("Error on %s: stream block at %ld failed to decompress!\n", file_name, pos);
+			exit(1);
+		}
+		ip += sizeof(int) + chunk;
+	}
+	lz77_stream_free(&stream);
+
+	if (compare(file_name, file_buffer, uncompressed_buffer, file_size))
+		exit(1);
+
+	double ratio = (100.0 * compressed_size) / file_size;
+	printf("%25s %10ld  -> %10ld  (%.2f%%)\n", name, file_size, compressed_size, ratio);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+}
+
+/* round-trip every level, report the ratio of the highest one */
+void test_roundtrip_levels(const char* name, const char* file_name)
+{
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64);
+	uint8_t* uncompressed_buffer = malloc(file_size + 1);
+	int compressed_size = 0;
+	int level;
+
+	for (level = LZ77_LEVEL_MIN; level <= LZ77_LEVEL_MAX; ++level) {
+		compressed_size = lz77_compress_level(file_buffer, file_size, compressed_buffer, level);
+		memset(uncompressed_buffer, '-', file_size);
+		if (lz77_decompress(compressed_buffer, compressed_size, uncompressed_buffer, file_size) != file_size) {
+			printf("Error on %s: level %d failed to decompress!\n", file_name, level);
+			exit(1);
+		}
+		if (compare(file_name, file_buffer, uncompressed_buffer, file_size))
+			exit(1);
+	}
+
+	double ratio = (100.0 * compressed_size) / file_size;
+	printf("%25s %10ld  -> %10d  (%.2f%%)\n", name, file_size, compressed_size, ratio);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+}
+
+/* statistics must not change the output and must account for every byte */
+void test_roundtrip_stats(const char* name, const char* file_name)
+{
+	const int levels[] = {LZ77_LEVEL_MIN, 2, LZ77_LEVEL_ULTRA};
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64);
+	uint8_t* reference_buffer = malloc(1.05 * file_size + 64);
+	lz77_stats stats;
+	unsigned long lengths, distances;
+	int compressed_size, b, k;
+
+	for (k = 0; k < 3; ++k) {
+		lz77_stats_init(&stats);
+		compressed_size = lz77_compress_ex(file_buffer, file_size, compressed_buffer, levels[k], &stats);
+		if (compressed_size != lz77_compress_level(file_buffer, file_size, reference_buffer, levels[k]) ||
+			memcmp(compressed_buffer, reference_buffer, compressed_size)) {
+			printf("Error on %s: level %d output differs with statistics!\n", file_name, levels[k]);
+			exit(1);
+		}
+		for (b = 0, lengths = 0, distances = 0; b < LZ77_STATS_BUCKETS; ++b) {
+			lengths += stats.length_histogram[b];
+			distances += stats.distance_histogram[b];
+		}
+		if (stats.literals + stats.match_bytes != (unsigned long)file_size ||
+			lengths != stats.matches || distances != stats.matches) {
+			printf("Error on %s: level %d statistics do not add up!\n", file_name, levels[k]);
+			exit(1);
+		}
+		if (k == 0)
+			printf("%25s %10ld  literals %9lu  matches %8lu  (avg %6.2f)  overwrites %8lu  rejects %7lu  splits %6lu\n",
+				name, file_size, stats.literals, stats.matches, stats.matches ? (double)stats.match_bytes / stats.matches : 0.0,
+				stats.hash_overwrites, stats.distance_rejects, stats.max_len_splits);
+	}
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(reference_buffer);
+}
+
+/*
+ * round-trip every power-of-two acceleration; the output may not exceed the
+ * literal-run overhead of 1 byte in 32, nor the input if level 1 shrinks it
+ */
+void test_roundtrip_fast(const char* name, const char* file_name)
+{
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64);
+	uint8_t* uncompressed_buffer = malloc(file_size + 1);
+	int compressed_size = 0;
+	int level1_size = lz77_compress(file_buffer, file_size, compressed_buffer);
+	int acceleration;
+
+	for (acceleration = 1; acceleration <= LZ77_ACCELERATION_MAX; acceleration *= 2) {
+		compressed_size = lz77_compress_fast(file_buffer, file_size, compressed_buffer, acceleration);
+		if (compressed_size > file_size + (file_size + 31) / 32 || (level1_size <= file_size && compressed_size > file_size)) {
+			printf("Error on %s: acceleration %d expanded %ld bytes to %d!\n", file_name, acceleration, file_size, compressed_size);
+			exit(1);
+		}
+		memset(uncompressed_buffer, '-', file_size);
+		if (lz77_decompress(compressed_buffer, compressed_size, uncompressed_buffer, file_size) != file_size) {
+			printf("Error on %s: acceleration %d failed to decompress!\n", file_name, acceleration);
+			exit(1);
+		}
+		if (compare(file_name, file_buffer, uncompressed_buffer, file_size))
+			exit(1);
+	}
+
+	double ratio = (100.0 * compressed_size) / file_size;
+	printf("%25s %10ld  -> %10d  (%.2f%%)\n", name, file_size, compressed_size, ratio);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+}
+
+/* round-trip the v2 format through the auto-detecting decompressor */
+void test_roundtrip_v2(const char* name, const char* file_name)
+{
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64);
+	uint8_t* uncompressed_buffer = malloc(file_size + 1);
+	int compressed_size = lz77_compress_v2(file_buffer, file_size, compressed_buffer);
+
+	memset(uncompressed_buffer, '-', file_size);
+	if (lz77_decompress(compressed_buffer, compressed_size, uncompressed_buffer, file_size) != file_size) {
+		printf("Error on %s: v2 failed to decompress!\n", file_name);
+		exit(1);
+	}
+	if (compare(file_name, file_buffer, uncompressed_buffer, file_size))
+		exit(1);
+
+	double ratio = (100.0 * compressed_size) / file_size;
+	printf("%25s %10ld  -> %10d  (%.2f%%)\n", name, file_size, compressed_size, ratio);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+}
+
+/* Huffman-code the literals (and the tokens) of a v1 block and decode it back */
+void test_roundtrip_huff(const char* name, const char* file_name)
+{
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64);
+	uint8_t* coded_buffer = malloc(1.05 * file_size + 64 + LZ77_HUFF_OVERHEAD);
+	uint8_t* uncompressed_buffer = malloc(file_size + 1);
+	uint8_t* scratch = malloc(LZ77_HUFF_SCRATCH(file_size));
+	int compressed_size = lz77_compress(file_buffer, file_size, compressed_buffer);
+	int coded_size = 0;
+	int flags;
+
+	for (flags = 0; flags <= LZ77_HUFF_TOKENS; ++flags) {
+		coded_size = lz77_huff_encode(compressed_buffer, compressed_size, coded_buffer, flags);
+		if (coded_size <= 0 || coded_size > compressed_size + LZ77_HUFF_OVERHEAD) {
+			printf("Error on %s: Huffman stage failed to encode!\n", file_name);
+			exit(1);
+		}
+		if (lz77_decompress(coded_buffer, coded_size, uncompressed_buffer, file_size) != 0) {
+			printf("Error on %s: plain decompressor accepted a Huffman block!\n", file_name);
+			exit(1);
+		}
+
+		memset(uncompressed_buffer, '-', file_size);
+		if (lz77_huff_decode(coded_buffer, coded_size, uncompressed_buffer, file_size, scratch) != file_size) {
+			printf("Error on %s: Huffman stage failed to decode!\n", file_name);
+			exit(1);
+		}
+		if (compare(file_name, file_buffer, uncompressed_buffer, file_size))
+			exit(1);
+		if (file_size > 1 && lz77_huff_decode(coded_buffer, coded_size, uncompressed_buffer, file_size - 1, scratch) != 0) {
+			printf("Error on %s: Huffman stage decoded into a short buffer!\n", file_name);
+			exit(1);
+		}
+	}
+
+	double ratio = (100.0 * coded_size) / file_size;
+	printf("%25s %10ld  -> %10d  -> %10d  (%.2f%%)\n", name, file_size, compressed_size, coded_size, ratio);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(coded_buffer);
+	free(uncompressed_buffer);
+	free(scratch);
+}
+
+/* use the first 8 KB as dictionary for the rest, compressed as 1 KB messages */
+void test_roundtrip_dict(const char* name, const char* file_name)
+{
+	const int message_size = 1024;
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	long dict_size = file_size < LZ77_WINDOW_SIZE ? file_size / 2 : LZ77_WINDOW_SIZE;
+	uint8_t* compressed_buffer = malloc(2 * message_size);
+	uint8_t* uncompressed_buffer = malloc(message_size);
+	lz77_dict* dict = malloc(sizeof(lz77_dict));
+	long pos, compressed_size = 0;
+	int message, chunk;
+
+	lz77_dict_init(dict, file_buffer, dict_size);
+	for (pos = dict_size; pos < file_size; pos += message) {
+		message = file_size - pos < message_size ? file_size - pos : message_size;
+		chunk = lz77_compress_dict(dict, file_buffer + pos, message, compressed_buffer);
+		memset(uncompressed_buffer, '-', message);
+		if (lz77_decompress_dict(dict, compressed_buffer, chunk, uncompressed_buffer, message) != message) {
+			printf("Error on %s: dictionary message at %ld failed to decompress!\n", file_name, pos);
+			exit(1);
+		}
+		if (compare(file_name, file_buffer + pos, uncompressed_buffer, message))
+			exit(1);
+		compressed_size += chunk;
+	}
+
+	double ratio = (100.0 * compressed_size) / (file_size - dict_size);
+	printf("%25s %10ld  -> %10ld  (%.2f%%)\n", name, file_size - dict_size, compressed_size, ratio);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+	free(dict);
+}
+
+/* one context for all files must give the same output as lz77_compress */
+void test_roundtrip_cctx(lz77_cctx* ctx, const char* name, const char* file_name)
+{
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* expected_buffer = malloc(1.05 * file_size + 64);
+	uint8_t* compressed_buffer = malloc(1.05 * file_size + 64);
+	int expected_size = lz77_compress(file_buffer, file_size, expected_buffer);
+	int compressed_size = lz77_compress_cctx(ctx, file_buffer, file_size, compressed_buffer);
+
+	if (compressed_size != expected_size || compare(file_name, expected_buffer, compressed_buffer, expected_size)) {
+		printf("Error on %s: context output differs from lz77_compress!\n", file_name);
+		exit(1);
+	}
+
+	double ratio = (100.0 * compressed_size) / file_size;
+	printf("%25s %10ld  -> %10d  (%.2f%%)\n", name, file_size, compressed_size, ratio);
+
+	free(file_buffer);
+	free(expected_buffer);
+	free(compressed_buffer);
+}
+
+/* 128 KB blocks that do not shrink by 1/16 are given up on, the rest must round-trip */
+void test_roundtrip_limit(lz77_cctx* ctx, const char* name, const char* file_name)
+{
+	const int block_size = 128 * 1024;
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	uint8_t* compressed_buffer = malloc(1.05 * block_size + 64);
+	uint8_t* uncompressed_buffer = malloc(block_size);
+	long pos, compressed_size = 0;
+	int block, limit, chunk, stored = 0, blocks = 0;
+
+	for (pos = 0; pos < file_size; pos += block) {
+		block = file_size - pos < block_size ? file_size - pos : block_size;
+		limit = block - block / 16;
+		chunk = lz77_compress_limit(ctx, file_buffer + pos, block, compressed_buffer, limit);
+		blocks++;
+		if (chunk == 0) {
+			stored++;
+			compressed_size += block;
+			continue;
+		}
+		if (chunk > limit) {
+			printf("Error on %s: block at %ld exceeds the limit!\n", file_name, pos);
+			exit(1);
+		}
+		memset(uncompressed_buffer, '-', block);
+		if (lz77_decompress(compressed_buffer, chunk, uncompressed_buffer, block) != block) {
+			printf("Error on %s: block at %ld failed to decompress!\n", file_name, pos);
+			exit(1);
+		}
+		if (compare(file_name, file_buffer + pos, uncompressed_buffer, block))
+			exit(1);
+		compressed_size += chunk;
+	}
+
+	double ratio = (100.0 * compressed_size) / file_size;
+	printf("%25s %10ld  -> %10ld  (%.2f%%)  %d of %d blocks stored\n", name, file_size, compressed_size, ratio, stored, blocks);
+
+	free(file_buffer);
+	free(compressed_buffer);
+	free(uncompressed_buffer);
+}
+
+/* Adler-32 one byte at a time, as RFC 1950 defines it */
+unsigned long reference_adler32(unsigned long checksum, const uint8_t* p, long length)
+{
+	unsigned long s1 = checksum & 0xffff;
+	unsigned long s2 = (checksum >> 16) & 0xffff;
+	long i;
+
+	for (i = 0; i < length; ++i) {
+		s1 = (s1 + p[i]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+
+	return (s2 << 16) + s1;
+}
+
+void test_checksums(const char* name, const char* file_name)
+{
+	long file_size;
+	uint8_t* file_buffer = load_file(name, file_name, &file_size);
+	if (!file_buffer)
+		return;
+
+	/* misaligned starts, odd lengths and split calls around the 32-byte blocks */
+	unsigned long expected = reference_adler32(1L, file_buffer, file_size);
+	unsigned long checksum = update_adler32(1L, file_buffer, file_size);
+	long offset, split;
+
+	for (offset = 1; offset < 4 && checksum == expected && offset < file_size; ++offset) {
+		unsigned long tail = reference_adler32(1L, file_buffer + offset, file_size - offset - 1);
+		if (update_adler32(1L, file_buffer + offset, file_size - offset - 1) != tail)
+			checksum = tail ^ 1;
+	}
+	for (split = 1; split < 100 && checksum == expected && split < file_size; split += 31) {
+		unsigned long part = update_adler32(1L, file_buffer, split);
+		if (update_adler32(part, file_buffer + split, file_size - split) != expected)
+			checksum = expected ^ 1;
+	}
+
+	if (checksum != expected) {
+		printf("Error on %s: Adler-32 %08lx, expecting %08lx!\n", file_name, checksum, expected);
+		exit(1);
+	}
+
+	printf("%25s %10ld  adler32 %08lx  xxh64 %08lx\n", name, file_size, checksum, chunk_data_checksum(CHUNK_XXH64, file_buffer, file_size));
+	free(file_buffer);
+}
+
 int main(int argc, char** argv)
 {
 	const char* default_prefix = "../dataset/";
@@ -131,6 +564,8 @@ int main(int argc, char** argv)
 	const int count = sizeof(names) / sizeof(names[0]);
 	int i;
 
+	printf("Kernel variant: %s\n\n", lz77_kernel_name());
+
 	printf("Test round-trip for lz77\n\n");
 	for (i = 0; i < count; ++i) {
 		const char* name = names[i];
@@ -142,5 +577,123 @@ int main(int argc, char** argv)
 	}
 	printf("\n");
 
+	printf("Test round-trip for lz77 stream (64 KB blocks)\n\n");
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_stream(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test round-trip for lz77 levels %d..%d (showing level %d)\n\n", LZ77_LEVEL_MIN, LZ77_LEVEL_MAX, LZ77_LEVEL_MAX);
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_levels(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test lz77 compression statistics (levels 1, 2 and %d, showing level 1)\n\n", LZ77_LEVEL_ULTRA);
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_stats(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test round-trip for lz77 acceleration 1..%d (showing %d)\n\n", LZ77_ACCELERATION_MAX, LZ77_ACCELERATION_MAX);
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_fast(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test round-trip for lz77 format v2\n\n");
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_v2(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test round-trip for lz77 Huffman stage (literals and tokens)\n\n");
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_huff(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test round-trip for lz77 dictionary (1 KB messages)\n\n");
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_dict(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test lz77 compression context reuse\n\n");
+	lz77_cctx* ctx = malloc(sizeof(lz77_cctx));
+	lz77_cctx_init(ctx);
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_cctx(ctx, name, filename);
+		free(filename);
+	}
+	printf("\n");
+
+	printf("Test lz77 compression limit (stored blocks)\n\n");
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_roundtrip_limit(ctx, name, filename);
+		free(filename);
+	}
+	free(ctx);
+	printf("\n");
+
+	/* low 32 bits of the XXH64 test vectors of "" and "abc" */
+	printf("Test chunk checksums (Adler-32 variant %s, XXH64)\n\n", adler32_kernel_name());
+	if (chunk_data_checksum(CHUNK_XXH64, "", 0) != 0x51d8e999UL || chunk_data_checksum(CHUNK_XXH64, "abc", 3) != 0xad770999UL) {
+		printf("Error: XXH64 does not match its test vectors!\n");
+		exit(1);
+	}
+	for (i = 0; i < count; ++i) {
+		const char* name = names[i];
+		char* filename = malloc(strlen(prefix) + strlen(name) + 1);
+		strcpy(filename, prefix);
+		strcat(filename, name);
+		test_checksums(name, filename);
+		free(filename);
+	}
+	printf("\n");
+
 	return 0;
 }